@@ -22,10 +22,15 @@
 # include <QString>
 # include <QStringList>
 
+# include <vector>
+# include <functional>
+
 
 namespace ItemTree
 {
+class Node;
 class Tree;
+class TreeBuilder;
 }
 
 namespace AddingItems
@@ -89,6 +94,19 @@ inline bool operator != (const Policy & lhs, const Policy & rhs)
 void addDir(const QString & dirName, const Patterns & patterns,
             const Policy & policy, ItemTree::Tree & itemTree);
 
+/// @brief Same as above, but adds found items to treeBuilder. This is much
+/// faster for large directories: call treeBuilder.build() after adding all
+/// directories.
+void addDir(const QString & dirName, const Patterns & patterns,
+            const Policy & policy, ItemTree::TreeBuilder & treeBuilder);
+
+/// @brief Creates ItemTree::ItemClassifier that assigns class c to Items that
+/// match "*.extension" patterns from patternsPerClass[c] (e.g.
+/// allAudioPatterns() or { "*.flac" }). Other patterns are ignored.
+/// Pass the result to ItemTree::Tree::setItemClassifier().
+std::function<int (const ItemTree::Node &)> patternClassifier(
+    const std::vector<QStringList> & patternsPerClass);
+
 }
 
 # endif // VENTUROUS_CORE_ADDING_ITEMS_HPP
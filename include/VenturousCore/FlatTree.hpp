@@ -0,0 +1,133 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_FLAT_TREE_HPP
+# define VENTUROUS_CORE_FLAT_TREE_HPP
+
+# include <cstddef>
+# include <cstdint>
+# include <vector>
+# include <string>
+
+
+namespace ItemTree
+{
+class Tree;
+
+template <class FlatLayout>
+void appendFlatItemPath(const FlatLayout & layout, int itemId,
+                        std::string & path);
+
+/// @brief Immutable tree, stored in contiguous struct-of-arrays form instead
+/// of nested nodes. Nodes are identified by indices in breadth-first order:
+/// node 0 is root, children of each node have consecutive indices.
+/// Answers the same queries as Tree (itemCount(), getItemAbsolutePath()) with
+/// no per-node allocations and cache-friendly descent. Takes several times
+/// less memory than Tree.
+class FlatTree
+{
+public:
+    /// @brief Constructs empty tree.
+    explicit FlatTree();
+
+    /// @brief Constructs a copy of tree.
+    /// NOTE: Tree::nodesChanged() must be called before this constructor if
+    /// tree was modified.
+    explicit FlatTree(const Tree & tree);
+
+    /// @brief Replaces contents of this tree with a copy of tree.
+    /// NOTE: Tree::nodesChanged() must be called before this method if tree
+    /// was modified.
+    void assign(const Tree & tree);
+
+    /// @brief Loads tree from file in any format, supported by Tree, and
+    /// replays journal of the file (see Journal), if it exists.
+    /// Files in Tree::Format::mappable without journal are loaded directly
+    /// into arrays, without constructing Tree.
+    /// @return Empty string if loading was successful. Error message otherwise.
+    /// If error occurs, this tree is empty.
+    std::string load(const std::string & filename);
+
+    /// @brief Saves tree to file in Tree::Format::mappable.
+    /// @return true if saving was successful.
+    bool save(const std::string & filename) const;
+
+    int itemCount() const { return accumulatedItemCounts_.front(); }
+
+    /// @param itemId Sequence number of required Item (starting from 0).
+    /// @return Specified Item's absolute path.
+    /// @throw Error If there is no such Item.
+    std::string getItemAbsolutePath(int itemId) const;
+
+    /// @brief Replaces contents of path with specified Item's absolute path.
+    /// Reusing the same path buffer for many calls avoids heap allocations.
+    /// @throw Error If there is no such Item.
+    void getItemAbsolutePath(int itemId, std::string & path) const;
+
+    /// @return Number of nodes including root.
+    std::uint32_t nodeCount() const {
+        return static_cast<std::uint32_t>(firstChildren_.size());
+    }
+
+    /// @return Pointer to the (not null-terminated) name of node.
+    const char * name(std::uint32_t node) const {
+        return names_.data() + nameOffsets_[node];
+    }
+    std::uint32_t nameSize(std::uint32_t node) const {
+        return nameOffsets_[node + 1] - nameOffsets_[node];
+    }
+    bool isPlayable(std::uint32_t node) const { return playable_[node]; }
+    std::uint32_t firstChild(std::uint32_t node) const {
+        return firstChildren_[node];
+    }
+    std::uint32_t childCount(std::uint32_t node) const {
+        return childCounts_[node];
+    }
+    /// @return Number of Items before {next node on the same level as node}.
+    int accumulatedItemCount(std::uint32_t node) const {
+        return accumulatedItemCounts_[node];
+    }
+
+private:
+    template <class FlatLayout>
+    friend void appendFlatItemPath(const FlatLayout &, int, std::string &);
+
+    /// @brief Makes this tree empty (only root remains).
+    void clear();
+
+    /// @brief Loads tree in Tree::Format::mappable from [data, data + size).
+    std::string loadMappable(const char * data, std::size_t size);
+
+    /// In-memory arrays are always consistent, so nothing is checked.
+    void checkName(std::uint32_t) const {}
+    void checkChildren(std::uint32_t) const {}
+
+    /// Names of all nodes without separators.
+    std::string names_;
+    /// Name of node i occupies [nameOffsets_[i], nameOffsets_[i + 1]) in
+    /// names_. Therefore size of this collection is nodeCount() + 1.
+    std::vector<std::uint32_t> nameOffsets_;
+    std::vector<std::uint32_t> firstChildren_;
+    std::vector<std::uint32_t> childCounts_;
+    std::vector<int> accumulatedItemCounts_;
+    std::vector<bool> playable_;
+};
+
+}
+
+# endif // VENTUROUS_CORE_FLAT_TREE_HPP
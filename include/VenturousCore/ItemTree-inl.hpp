@@ -23,6 +23,7 @@
 
 # include <TemplateUtilities/Resize.hpp>
 
+# include <cstddef>
 # include <cassert>
 # include <string>
 # include <iterator>
@@ -58,22 +59,49 @@ StringCollection Node::getAllItems() const
     StringCollection result;
     const auto nItems =
         static_cast<typename StringCollection::size_type>(itemCount());
-    if (name_.empty()) // root
+    if (name().empty()) // root
         TemplateUtilities::resize(result, nItems);
     else
-        TemplateUtilities::resize(result, nItems, name_ + '/');
+        TemplateUtilities::resize(result, nItems, name() + '/');
     using std::begin;
     addAllItemsRelative(begin(result));
     return result;
 }
 
 
+template <typename Visitor>
+void Node::forEachItem(Visitor visitor) const
+{
+    std::string path = name();
+    visitItems(path, 0, visitor);
+}
+
+template <typename Visitor>
+int Node::visitItems(std::string & path, int itemId, Visitor & visitor) const
+{
+    if (playable_) {
+        visitor(itemId, static_cast<const std::string &>(path));
+        ++itemId;
+    }
+    const std::size_t size = path.size();
+    for (const Node & child : children_) {
+        // Root has empty name, its children's paths start without '/'.
+        if (size != 0)
+            path += '/';
+        path += child.name();
+        itemId = child.visitItems(path, itemId, visitor);
+        path.resize(size);
+    }
+    return itemId;
+}
+
+
 template <typename ForwardStringIterator>
 ForwardStringIterator Node::addAllItems(const ForwardStringIterator begin) const
 {
     ForwardStringIterator it = begin;
-    const std::string path = name_ + '/';
-    // Add "<name_>/" to this node's (if it is an Item) and all descendants'
+    const std::string path = name() + '/';
+    // Add "<name()>/" to this node's (if it is an Item) and all descendants'
     // paths.
     for (int i = itemCount(); i > 0; --i, ++it)
         * it += path;
@@ -21,16 +21,24 @@
 
 # include <CommonUtilities/CopyAndMoveSemantics.hpp>
 
+# include <cstddef>
 # include <cstdint>
+# include <utility>
 # include <vector>
 # include <deque>
+# include <memory>
 # include <string>
+# include <iosfwd>
 # include <stdexcept>
 # include <random>
+# include <functional>
 
 
 namespace ItemTree
 {
+class MappableLayout;
+class Node;
+
 class Error : public std::runtime_error
 {
 public:
@@ -40,35 +48,107 @@ public:
 };
 
 
+/// @brief Assigns class (e.g. file type) to Items.
+/// @return Class of the Item in range [0, Tree::itemClassCount()) or -1 if
+/// the Item does not belong to any class.
+/// NOTE: must be thread-safe.
+typedef std::function<int (const Node &)> ItemClassifier;
+
+/// @brief Receives absolute path of an Item.
+typedef std::function<void (const std::string &)> ItemPathVisitor;
+
+/// @brief Classifies Items by name extension (case-insensitive for ASCII).
+/// @param extensionsPerClass extensionsPerClass[c] contains extensions
+/// (without '.') of Items of class c.
+ItemClassifier extensionClassifier(
+    const std::vector<std::vector<std::string>> & extensionsPerClass);
+
+
+/// @brief Absolute paths of all Items, packed in a single buffer.
+struct PackedItems {
+    /// @return Number of Items.
+    std::size_t size() const { return offsets.size() - 1; }
+
+    /// @return Pointer to the (not null-terminated) path of Item with
+    /// specified itemId.
+    const char * path(std::size_t itemId) const {
+        return data.data() + offsets[itemId];
+    }
+    std::size_t pathSize(std::size_t itemId) const {
+        return offsets[itemId + 1] - offsets[itemId];
+    }
+
+    /// Concatenated paths of all Items in itemId order without separators.
+    std::string data;
+    /// Path of Item i occupies [offsets[i], offsets[i + 1]) in data.
+    /// Therefore size of this collection is {Item count} + 1.
+    std::vector<std::size_t> offsets { 0 };
+};
+
+
 /// @brief Playable entity (directory or file) is called "Item".
 /// Node can be either Item or directory that contains Items at some nesting
 /// level.
 class Node
 {
 public:
-    const std::string & name() const { return name_; }
+    Node(const Node & other);
+    Node(Node &&) = default;
+    Node & operator = (const Node & other);
+    Node & operator = (Node &&) = default;
+
+    const std::string & name() const;
     bool isPlayable() const { return playable_; }
 
     const std::vector<Node> & children() const { return children_; }
-    /// NOTE (2).
-    std::vector<Node> & children() { return children_; }
+    /// NOTE (2), (3).
+    std::vector<Node> & children() {
+        dirty_ = true;
+        clearChildIndex();
+        return children_;
+    }
 
     /// @return Number of playable descendants. If this node is playable, it
     /// is included in itemCount() too.
     int itemCount() const;
 
+    /// @return Structural hash of this node and its descendants (names,
+    /// playable flags, children). Equal subtrees have equal hashes, so
+    /// differing subtrees of two trees can be found by comparing hashes.
+    /// NOTE: hashes depend on the process-wide name pool, so they are only
+    /// comparable within the same process.
+    /// NOTE: Tree::nodesChanged() must be called after modifying tree.
+    std::uint64_t hash() const { return hash_; }
+
     /// NOTE (1).
-    void setPlayable(bool playable) { playable_ = playable; }
+    void setPlayable(bool playable) {
+        playable_ = playable;
+        dirty_ = true;
+    }
 
     /// @return Pointer to child with specified name. If there is no such child,
     /// nullptr is returned.
-    /// NOTE (2).
-    Node * child(const std::string & name);
+    /// NOTE (2), (3).
+    Node * child(const std::string & name) {
+        return child(name.data(), name.size());
+    }
+    /// @brief Same as above, but name is specified by pointer and size and
+    /// does not need to be null-terminated. Does not allocate memory.
+    /// NOTE (2), (3).
+    Node * child(const char * name, std::size_t nameSize);
+
+    /// @return Pointer to child with specified name or nullptr.
+    /// Does not allocate memory. Children of wide nodes are found in O(1)
+    /// average time via hash index, others - by binary search.
+    const Node * child(const std::string & name) const {
+        return child(name.data(), name.size());
+    }
+    const Node * child(const char * name, std::size_t nameSize) const;
 
     /// @return Pointer to descendant with path, specified by [begin, end).
     /// If there is no such child, nullptr is returned. In this case not all
     /// iterators in the specified range may be reached.
-    /// NOTE (2).
+    /// NOTE (2), (3).
     template <typename InputStringIterator>
     Node * descendant(InputStringIterator begin, InputStringIterator end);
 
@@ -78,7 +158,7 @@ public:
     /// and collection ends on this position. In this case returned collection's
     /// size can be smaller than std::distance(begin, end). Also in this case
     /// not all iterators in the specified range may be reached.
-    /// NOTE (2).
+    /// NOTE (2), (3).
     template <typename InputStringIterator>
     std::deque<Node *> descendantPath(
         InputStringIterator begin, InputStringIterator end);
@@ -91,24 +171,55 @@ public:
     template <class StringCollection = std::vector<std::string>>
     StringCollection getAllItems() const;
 
+    /// @brief Calls visitor(itemId, path) for each Item - descendant of this
+    /// node (including this node if it is playable) in itemId order.
+    /// Uses constant extra memory (apart from the path buffer).
+    /// @param visitor Function object that accepts (int, const std::string &).
+    /// itemId is relative to this node (starts from 0). path starts with
+    /// this->name(), as in getAllItems(). path refers to a buffer that is
+    /// reused for all calls, so it is valid only during the call.
+    template <typename Visitor>
+    void forEachItem(Visitor visitor) const;
+
 private:
     friend class Tree;
+    friend class TreeBuilder;
 
     friend bool operator == (const Node &, const Node &);
 
-    explicit Node(std::string name, bool playable);
+    explicit Node(const std::string & name, bool playable);
+    explicit Node(const char * name, std::size_t nameSize, bool playable);
+    /// @param nameId Id of already interned name.
+    explicit Node(std::uint32_t nameId, bool playable);
 
+    /// @brief Appends specified descendant Item's path, relative to this node,
+    /// to path. Each appended name is followed by '/'. No memory is allocated
+    /// if path has enough capacity.
     /// @param relativeId Id shift relative to this node.
     /// @throw Error If there are not enough children.
-    /// @return Specified child Item's path relative to this node.
-    /// NOTE: this method is called for root node to avoid extra '/'.
-    /// This method is also called by getChildItemPath().
-    std::string getRelativeChildItemPath(int relativeId) const;
-
-    /// @param relativeId Id shift relative to this node.
+    void appendRelativeItemPath(int relativeId, std::string & path) const;
+
+    /// @brief Resolves paths of several Items in a single traversal.
+    /// @param begin, end Sorted range of {itemId, result index} pairs.
+    /// itemId - offset is relative to this node for each of them.
+    /// @param path Must contain this node's path. Common prefixes of resolved
+    /// paths are built in it once.
+    /// @param result Path of each Item is assigned to result[its index].
     /// @throw Error If there are not enough children.
-    /// @return Specified child Item's path, which includes this node's name.
-    std::string getChildItemPath(int relativeId) const;
+    void resolveItemPaths(const std::pair<int, std::size_t> * begin,
+                          const std::pair<int, std::size_t> * end,
+                          int offset, std::string & path,
+                          std::vector<std::string> & result) const;
+
+    /// @param pathSize Size of this node's path.
+    /// @return Total size of paths of all Items - descendants of this node
+    /// (including this node if it is playable).
+    std::size_t itemPathsSize(std::size_t pathSize) const;
+
+    /// @brief Implements forEachItem(). path must contain this node's path.
+    /// @return itemId after the last visited Item.
+    template <typename Visitor>
+    int visitItems(std::string & path, int itemId, Visitor & visitor) const;
 
     /// @brief Appends all playable descendants' paths (including this node)
     /// to ends of strings, starting from begin. this->itemCount() paths will be
@@ -124,43 +235,172 @@ private:
     template <typename ForwardStringIterator>
     void addAllItemsRelative(ForwardStringIterator begin) const;
 
+    /// @return Iterator to the child with specified name or children_.end()
+    /// if there is no such child.
+    std::vector<Node>::iterator findChild(const char * name,
+                                          std::size_t nameSize);
+    std::vector<Node>::const_iterator findChild(const char * name,
+            std::size_t nameSize) const;
+
+    /// @brief Builds ChildTables::index if this node has at least
+    /// childIndexThreshold children, clears it otherwise.
+    void buildChildIndex();
+    void clearChildIndex();
+
+    /// @brief Destroys childTables_ if all its fields are empty.
+    void releaseEmptyChildTables();
+
     /// @brief Inserts new Item as a descendant. If descendant with specified
     /// name already exists, it becomes (or remains) an Item.
-    /// @param relativePath Path to the new Item relative to this node.
-    /// NOTE (1).
-    void insertItem(std::string relativePath);
-
-    /// @brief Recalculates accumulatedItemCount_ for current node and its
-    /// descendants.
+    /// @param path, begin Path to the new Item relative to this node is
+    /// [begin, path.size()) of path.
+    /// @param updateCounts If true, accumulatedItemCount_ of affected
+    /// descendants is updated, so that it remains valid.
+    /// @return Change of itemCount() (0 or 1).
+    /// NOTE (1) if updateCounts is false.
+    int insertItem(const std::string & path, std::size_t begin,
+                   bool updateCounts);
+
+    /// @brief Makes descendant with path [begin, path.size()) of path
+    /// unplayable. Removes nodes on this path that become unplayable and
+    /// have no children.
+    /// @param updateCounts If true, accumulatedItemCount_ of affected
+    /// descendants is updated, so that it remains valid.
+    /// @return Change of itemCount() (0 or -1).
+    /// NOTE (1) if updateCounts is false.
+    int removeItem(const std::string & path, std::size_t begin,
+                   bool updateCounts);
+
+    /// @brief Adds delta to accumulatedItemCount_ of all children.
+    void shiftChildrenCounts(int delta);
+
+    /// @brief Recalculates accumulatedItemCount_ and class counts for
+    /// current node and its dirty descendants. Descendants of clean nodes are
+    /// not visited.
     /// @param precedingCount Accumulated Item count before this node.
-    void recalculateItemCount(int precedingCount);
+    /// @param classCount Number of Item classes, 0 if Tree has no
+    /// ItemClassifier.
+    void recalculateItemCount(int precedingCount, std::size_t classCount,
+                              const ItemClassifier & classifier);
+
+    /// @return true if this node has class counts for classCount classes.
+    /// NOTE: counts can be out of date if this node is dirty.
+    bool hasClassCounts(std::size_t classCount) const;
+
+    /// @return Number of Items of specified class - descendants of this node
+    /// (including this node).
+    /// NOTE: this node must be clean and hasClassCounts() must return true.
+    int classItemCount(std::size_t itemClass) const;
+
+    /// @return Relative id of index-th (starting from 0) Item of specified
+    /// class among descendants of this node.
+    int classItemId(std::size_t itemClass, int index) const;
+
+    /// @brief Implements Tree::diff() for a pair of nodes with equal names.
+    /// @param path Must contain path of these nodes.
+    void diff(const Node & newNode, std::string & path,
+              const ItemPathVisitor & added,
+              const ItemPathVisitor & removed) const;
+
+    /// @brief Implements Tree::merge() for a pair of nodes with equal names.
+    void merge(const Node & other);
+
+    /// @brief Recalculates hash_ from this node's fields and children's
+    /// hashes.
+    void updateHash();
+
+    /// @brief Marks this node and all its descendants dirty and clears their
+    /// child indices, which are rebuilt by recalculateItemCount().
+    void markAllDirty();
 
     /// @brief Removes nodes that are not Items and have no playable
     /// descendants.
     void cleanUp();
+    /// @brief Removes children that are not Items and have no playable
+    /// descendants (not recursively).
+    void cleanUpChildren();
 
     /// @throw Error If this node is invalid (has descendants with empty or
     /// duplicate names, children() are not sorted properly).
     void validate() const;
+    /// @brief Same as validate(), but does not check descendants of children.
+    void validateChildren() const;
+
+    /// @brief Appends this node and all its descendants to buffer in binary
+    /// format.
+    void appendBinary(std::string & buffer) const;
+
+    /// @brief Appends record of this node without its descendants to buffer
+    /// in binary format.
+    void appendBinaryRecord(std::string & buffer) const;
+
+    /// @brief Reads accumulatedItemCount_ and children (recursively) of this
+    /// node in binary format, starting from pos. pos is advanced past the
+    /// last read byte.
+    /// @throw Error If data is truncated or inconsistent.
+    void readBinary(const char * & pos, const char * end);
+
+    /// @brief Reads accumulatedItemCount_ and children (recursively) of this
+    /// node from record with specified index in layout.
+    /// @throw Error If layout is corrupted.
+    void readMappable(const MappableLayout & layout, std::uint32_t index);
 
 
-    /// Name of file or directory.
-    std::string name_;
+    static constexpr std::uint8_t noItemClass = 0xFF;
+    /// Nodes with fewer children are searched by binary search only.
+    static constexpr std::size_t childIndexThreshold = 64;
+
+    /// Id of the name of file or directory in the process-wide name pool.
+    /// Equal names have equal ids.
+    std::uint32_t nameId_;
     /// Specifies whether this node is an Item or just an intermediate
     /// directory (or even unplayable [meaningless] file).
     bool playable_;
+    /// true if this node or some of its descendants might have been modified
+    /// since the last recalculateItemCount() call. Every non-const method
+    /// that gives access to descendants marks this node dirty, so dirty nodes
+    /// always form paths from root.
+    bool dirty_ = true;
+    /// Class of this Item or noItemClass.
+    std::uint8_t itemClass_ = noItemClass;
     /// Number of Items before {next node on the same level as this node}.
-    int accumulatedItemCount_;
+    int accumulatedItemCount_ = 0;
+    /// Merkle-style hash of this subtree. Is up to date if the node is clean.
+    std::uint64_t hash_ = 0;
+
+    /// Data about children that most nodes don't need. Is allocated only if
+    /// some of its fields are not empty, so it costs a single pointer in leaf
+    /// and narrow nodes of trees without ItemClassifier.
+    struct ChildTables {
+        /// accumulatedItemCount_ of each child for each Item class:
+        /// classCounts[i * classCount + c] is the number of Items of class c
+        /// up to and including i-th child (and this node). Is empty if Tree
+        /// has no ItemClassifier. Is up to date if the node is clean.
+        std::vector<int> classCounts;
+        /// Open-addressing hash table {nameId_ -> index in children_ + 1}
+        /// for wide nodes, 0 marks empty slot. Is empty if the node is
+        /// narrow or children_ were modified since the last
+        /// recalculateItemCount() call.
+        std::vector<std::uint32_t> index;
+    };
+
     /// Collection of nodes that are contained in this node's directory.
-    /// This collection is always sorted by name­_, is empty for file-nodes.
+    /// This collection is always sorted by name(), is empty for file-nodes.
     std::vector<Node> children_;
+    std::unique_ptr<ChildTables> childTables_;
 };
 
 inline bool operator == (const Node & lhs, const Node & rhs)
 {
-    return lhs.name_ == rhs.name_ && lhs.playable_ == rhs.playable_
-           && lhs.accumulatedItemCount_ == rhs.accumulatedItemCount_
-           && lhs.children_ == rhs.children_;
+    if (lhs.nameId_ != rhs.nameId_ || lhs.playable_ != rhs.playable_
+            || lhs.accumulatedItemCount_ != rhs.accumulatedItemCount_) {
+        return false;
+    }
+    // Hashes of clean nodes are up to date, comparing them is O(1).
+    // Equal hashes of different subtrees are astronomically unlikely.
+    if (! lhs.dirty_ && ! rhs.dirty_)
+        return lhs.hash_ == rhs.hash_;
+    return lhs.children_ == rhs.children_;
 }
 
 inline bool operator != (const Node & lhs, const Node & rhs)
@@ -172,37 +412,67 @@ inline bool operator != (const Node & lhs, const Node & rhs)
 class Tree
 {
 public:
+    /// File formats, supported by save(). load() detects format automatically.
+    enum class Format {
+        /// Human-readable format: one tab-indented node per line.
+        text,
+        /// Compact versioned format with length-prefixed names, child counts
+        /// and precomputed accumulated Item counts. Much faster to load.
+        binary,
+        /// Offset-based format with fixed-size node records. Can be queried
+        /// without parsing via MappedTree or loaded directly into FlatTree.
+        mappable
+    };
+
     /// @brief Constructs empty tree.
     explicit Tree();
 
+    /// @brief Removes all nodes.
+    void clear();
+
+    /// @brief Removes all nodes and destroys them in a background thread.
+    /// Destroying a tree with millions of nodes takes noticeable time because
+    /// of deallocating children collections of each node. This method returns
+    /// immediately, so it is suitable for GUI thread.
+    /// All trees share one background thread, which destroys their nodes in
+    /// order. The thread finishes its work and is joined at program exit.
+    /// NOTE: destructor of Tree destroys nodes synchronously. Call this
+    /// method before destroying a large tree in GUI thread.
+    void clearInBackground();
+
     /// @brief Removes all existing nodes and loads tree from file.
+    /// Then replays journal of the file (see Journal), if it exists.
+    /// Large previous tree is destroyed in background (see
+    /// clearInBackground()).
     /// @return Empty string if loading was successful. Error message otherwise.
     /// NOTE: if error occurs, this tree will be in undefined (maybe invalid)
     /// state.
     /// NOTE (1).
     std::string load(const std::string & filename);
 
-    /// @brief Saves tree to file.
+    /// @brief Saves tree to file in the specified format.
+    /// NOTE: journal of the file (see Journal) is not modified. Use
+    /// Journal::checkpoint() to save a journaled tree.
     /// @return true if saving was successful.
-    bool save(const std::string & filename) const;
+    bool save(const std::string & filename, Format format = Format::text) const;
 
     int itemCount() const { return root_.accumulatedItemCount_; }
 
     /// @return {subdirectories of root directory} or {disks} that were
     /// added to this tree.
     const std::vector<Node> & topLevelNodes() const { return root_.children(); }
-    /// NOTE (2).
+    /// NOTE (2), (3).
     std::vector<Node> & topLevelNodes() { return root_.children(); }
 
-    /// NOTE (2).
+    /// NOTE (2), (3).
     Node * child(const std::string & name) { return root_.child(name); }
 
-    /// NOTE (2).
+    /// NOTE (2), (3).
     template <typename InputStringIterator>
     Node * descendant(InputStringIterator begin, InputStringIterator end)
     { return root_.descendant(begin, end); }
 
-    /// NOTE (2).
+    /// NOTE (2), (3).
     template <typename InputStringIterator>
     std::deque<Node *> descendantPath(
         InputStringIterator begin, InputStringIterator end)
@@ -213,24 +483,136 @@ public:
         return root_.getAllItems<StringCollection>();
     }
 
+    /// @return Paths of all Items in one buffer. Requires 2 allocations
+    /// instead of one per Item as in getAllItems(). Subtrees of top-level
+    /// nodes are processed concurrently.
+    PackedItems getAllItemsPacked() const;
+
+    /// @brief Calls visitor(itemId, absolutePath) for all Items in itemId
+    /// order without materializing a collection of paths.
+    /// See Node::forEachItem() for details.
+    template <typename Visitor>
+    void forEachItem(Visitor visitor) const {
+        root_.forEachItem(std::move(visitor));
+    }
+
     /// @param itemId Sequence number of required Item (starting from 0).
     /// @return Specified Item's absolute path.
     std::string getItemAbsolutePath(int itemId) const;
 
+    /// @brief Replaces contents of path with specified Item's absolute path.
+    /// Reusing the same path buffer for many calls avoids heap allocations.
+    /// @param itemId Sequence number of required Item (starting from 0).
+    /// @throw Error If there is no such Item.
+    void getItemAbsolutePath(int itemId, std::string & path) const;
+
+    /// @return Absolute paths of specified Items in the same order.
+    /// Items are resolved in a single traversal of the tree in itemId order,
+    /// so common path prefixes are built only once. This is faster than
+    /// calling getItemAbsolutePath() for each of them.
+    /// @throw Error If some of itemIds are out of range.
+    std::vector<std::string> getItemAbsolutePaths(
+        const std::vector<int> & itemIds) const;
+
+    /// @param absolutePath Path to a node, split into names as in
+    /// insertItem(). Empty path means the whole tree.
+    /// @return Half-open range [first, last) of itemIds of all Items in the
+    /// node's subtree (including the node itself if it is playable).
+    /// Costs O(depth * log(fan-out)).
+    /// @throw Error If there is no such node.
+    std::pair<int, int> itemIdRange(const std::string & absolutePath) const;
+
+    /// @brief Inverse of getItemAbsolutePath(). Does not allocate memory.
+    /// Costs O(depth * log(fan-out)).
+    /// @param absolutePath, size Path to the Item (not necessarily
+    /// null-terminated), split into names as in insertItem().
+    /// @return itemId of the Item or -1 if there is no such Item.
+    int itemId(const char * absolutePath, std::size_t size) const;
+    int itemId(const std::string & absolutePath) const {
+        return itemId(absolutePath.data(), absolutePath.size());
+    }
+
+    /// @brief Reports difference between this (old) tree and newTree.
+    /// Children of corresponding nodes are walked in lockstep and subtrees
+    /// with equal hashes are skipped, so the cost is linear in the size of
+    /// the differing part of the trees.
+    /// @param added Is called for each Item of newTree that is not an Item
+    /// in this tree.
+    /// @param removed Is called for each Item of this tree that is not an Item
+    /// in newTree.
+    void diff(const Tree & newTree, const ItemPathVisitor & added,
+              const ItemPathVisitor & removed) const;
+
+    /// @brief Makes all Items of other Items of this tree too (union).
+    /// Children of corresponding nodes are merged in lockstep, subtrees that
+    /// are absent in this tree are copied as a whole. Calls nodesChanged().
+    void merge(const Tree & other);
+
+    /// @brief Sets classifier that divides Items into classCount classes,
+    /// e.g. by file type. Number of Items of each class is tracked in each
+    /// node, which allows choosing random Item of a class in
+    /// O(depth * log(fan-out)). Empty classifier disables classes.
+    /// Recalculates counts of all nodes.
+    /// NOTE: class counts are updated by nodesChanged(), so it must be called
+    /// before class queries even if isIncrementalCounting() is true.
+    /// @throw Error If classCount is not in range [0, 255).
+    void setItemClassifier(ItemClassifier classifier, int classCount);
+    int itemClassCount() const { return classCount_; }
+
+    /// @return Number of Items of specified class.
+    /// @throw Error If there is no such class or the tree was modified since
+    /// the last nodesChanged() call.
+    int itemCount(int itemClass) const;
+
+    /// @return itemId of index-th (starting from 0) Item of specified class.
+    /// @throw Error If there is no such Item or the tree was modified since
+    /// the last nodesChanged() call.
+    int classItemId(int itemClass, int index) const;
+
     /// @brief Inserts new Item in the tree. If node with specified name is
     /// already present in this tree, it becomes (or remains) an Item.
     /// @param absolutePath Path to the new Item.
-    /// NOTE (1).
-    void insertItem(std::string absolutePath);
+    /// NOTE (4).
+    void insertItem(const std::string & absolutePath);
+
+    /// @brief Removes Item from the tree. The node itself and its ancestors
+    /// are removed too if they become non-playable nodes without children.
+    /// @param absolutePath Path to the Item.
+    /// @return true if the Item was found and removed.
+    /// NOTE (4).
+    bool removeItem(const std::string & absolutePath);
+
+    /// @brief Switches incremental counting mode. In this mode insertItem()
+    /// and removeItem() keep Item counts up to date, so itemCount(),
+    /// getItemAbsolutePath() and RandomItemChooser remain valid without
+    /// nodesChanged() calls. Each insertion or removal then costs
+    /// O(depth * fan-out), which is the cost of inserting into children
+    /// collections anyway. Disabled by default.
+    /// NOTE: enabling this mode calls nodesChanged().
+    /// NOTE: other modifications (via Node's methods) still require
+    /// nodesChanged().
+    void setIncrementalCounting(bool enabled);
+    bool isIncrementalCounting() const { return incrementalCounting_; }
 
     /// @brief This method must be called after one or more calls of
     /// non-const Tree's or Node's methods; before itemCount(), getAllItems(),
     /// getItemAbsolutePath(), cleanUp(), comparing nodes or trees.
+    /// Only nodes, reached via non-const methods since the last call, and
+    /// their siblings are recalculated, so the cost is proportional to the
+    /// modified part of the tree. Node::hash() of these nodes is updated too,
+    /// which makes comparing unmodified subtrees O(1).
     void nodesChanged();
 
+    /// @brief Recalculates Item counts of all nodes. Unlike nodesChanged(),
+    /// works correctly even if NOTE (3) was violated.
+    void allNodesChanged();
+
     /// @brief Removes non-playable nodes with no playable descendants.
     void cleanUp();
 
+    /// NOTE: nodesChanged(), allNodesChanged(), cleanUp() and validate()
+    /// process independent subtrees concurrently if there are enough of them.
+
     /// @throw Error If this tree is invalid (empty or duplicate names,
     /// not sorted properly children).
     /// NOTE: Tree should never enter invalid state. If this method throws, it
@@ -238,12 +620,58 @@ public:
     void validate() const;
 
 private:
+    friend class TreeBuilder;
     friend bool operator == (const Tree &, const Tree &);
 
+    /// @param path, size Path to a node, split into names as in
+    /// insertItem().
+    /// @param firstItemId Is set to itemId of the first Item in node's subtree.
+    /// @return The node or nullptr if there is no such node.
+    const Node * findNode(const char * path, std::size_t size,
+                          int & firstItemId) const;
+
+    /// @brief Splits the tree into independent subtrees for concurrent
+    /// processing. Descends breadth-first from root until there are enough
+    /// subtrees for all hardware threads or no subtree can be split. Only root
+    /// is returned if processing it would visit too few nodes to be worth
+    /// starting threads.
+    /// @param isTask Returns true if the subtree of a node needs processing.
+    /// Other subtrees are skipped.
+    /// @param split Is called for each node that is split into its children,
+    /// before enumerating them. Split nodes are appended to splitNodes in
+    /// breadth-first order.
+    /// @return Roots of disjoint subtrees to be processed.
+    template <class NodeType, class IsTask, class Split>
+    static std::vector<NodeType *> splitIntoSubtrees(
+        NodeType & root, const IsTask & isTask, const Split & split,
+        std::vector<NodeType *> & splitNodes);
+
+    /// @brief Implements load().
+    std::string loadFile(const std::string & filename);
+
+    /// @brief Applies records of journal file to this tree.
+    /// @param changed Is set to true if some records were applied.
+    /// @return Empty string if journal does not exist or was replayed
+    /// successfully. Error message otherwise.
+    std::string replayJournal(const std::string & filename, bool & changed);
+
+    /// @brief Loads tree in text format from [begin, end).
+    std::string loadText(const char * begin, const char * end);
+
+    /// @brief Loads tree in binary format from [begin, end), which must not
+    /// include the header.
+    std::string loadBinary(const char * begin, const char * end);
+
+    /// @brief Loads tree in mappable format from [data, data + size).
+    std::string loadMappable(const char * data, std::size_t size);
+
     /// Although some systems do not have common root, this field is used
     /// to simplify code. root_ always has empty name and is not playable.
     /// Absolute paths that don't start with '/' are also supported.
     Node root_ { std::string(), false };
+    bool incrementalCounting_ = false;
+    ItemClassifier classifier_;
+    int classCount_ = 0;
 };
 
 inline bool operator == (const Tree & lhs, const Tree & rhs)
@@ -257,6 +685,75 @@ inline bool operator != (const Tree & lhs, const Tree & rhs)
 }
 
 
+/// @brief Append-only log of Item insertions and removals, stored next to a
+/// tree file. Persisting a change costs O(path size) instead of saving the
+/// whole tree. Tree::load() replays the journal on top of the tree file.
+/// When the journal grows large, checkpoint() saves the whole tree and
+/// starts a new empty journal.
+/// Each record is a line: insertSymbol or removeSymbol, then absolute path.
+/// Records are idempotent, so replaying a journal on top of a tree, which
+/// already contains some of its changes, gives the same result.
+/// NOTE: Node::setPlayable() changes should be recorded as insertItem() or
+/// removeItem() of the node's path.
+/// NOTE: FlatTree::load() replays the journal too, MappedTree ignores it.
+class Journal
+{
+public:
+    static constexpr char insertSymbol = '+', removeSymbol = '-';
+    static constexpr std::size_t defaultCheckpointSize = 1 << 20;
+
+    /// @return Name of the journal file of tree file treeFilename.
+    static std::string filename(const std::string & treeFilename) {
+        return treeFilename + ".journal";
+    }
+
+    /// @param treeFilename File, which the tree is loaded from and saved to.
+    explicit Journal(std::string treeFilename);
+
+    const std::string & treeFilename() const { return treeFilename_; }
+
+    /// @brief Appends insertion record to the journal file.
+    /// @param absolutePath Path, which was passed to Tree::insertItem().
+    /// @return true if writing was successful.
+    /// @throw Error If absolutePath contains line break.
+    bool insertItem(const std::string & absolutePath) {
+        return append(insertSymbol, absolutePath);
+    }
+
+    /// @brief Appends removal record to the journal file.
+    /// @param absolutePath Path, which was passed to Tree::removeItem().
+    /// @return true if writing was successful.
+    /// @throw Error If absolutePath contains line break.
+    bool removeItem(const std::string & absolutePath) {
+        return append(removeSymbol, absolutePath);
+    }
+
+    /// @return Size of the journal file in bytes.
+    std::size_t size() const { return size_; }
+
+    void setCheckpointSize(std::size_t size) { checkpointSize_ = size; }
+    std::size_t checkpointSize() const { return checkpointSize_; }
+
+    /// @return true if size() has reached checkpointSize(), so loading
+    /// the journal may take noticeable time.
+    bool needsCheckpoint() const { return size_ >= checkpointSize_; }
+
+    /// @brief Saves tree to a temporary file, which then replaces the tree
+    /// file, and removes the journal file. If saving is interrupted, the tree
+    /// file and the journal stay intact.
+    /// @return true if saving was successful.
+    bool checkpoint(const Tree & tree,
+                    Tree::Format format = Tree::Format::text);
+
+private:
+    bool append(char symbol, const std::string & absolutePath);
+
+    std::string treeFilename_;
+    std::size_t size_ = 0;
+    std::size_t checkpointSize_ = defaultCheckpointSize;
+};
+
+
 class RandomItemChooser
 {
 public:
@@ -268,19 +765,113 @@ public:
     /// @brief Constructs random engine using parameter value as a seed.
     explicit RandomItemChooser(Seed seed);
 
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
     /// @return Random itemId in the tree.
     /// @throw Error If there are no Items in the tree.
-    int randomItemId(const Tree & tree);
+    template <class ItemCollection>
+    int randomItemId(const ItemCollection & tree) {
+        return randomItemId(tree.itemCount());
+    }
 
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
     /// @return Absolute path to next random Item in the tree.
     /// @throw Error If there are no Items in the tree.
-    std::string randomPath(const Tree & tree) {
+    template <class ItemCollection>
+    std::string randomPath(const ItemCollection & tree) {
         return tree.getItemAbsolutePath(randomItemId(tree));
     }
 
+    /// @param itemIdRange Half-open range of itemIds, such as returned by
+    /// Tree::itemIdRange().
+    /// @return Random itemId in itemIdRange.
+    /// NOTE: exclusions (see setExclusionSize()) are not applied.
+    /// @throw Error If itemIdRange is empty.
+    int randomItemId(std::pair<int, int> itemIdRange);
+
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @return Absolute path to random Item in itemIdRange, e.g. in the
+    /// subtree of a single directory.
+    /// @throw Error If itemIdRange is empty.
+    template <class ItemCollection>
+    std::string randomPath(const ItemCollection & tree,
+                           const std::pair<int, int> itemIdRange) {
+        return tree.getItemAbsolutePath(randomItemId(itemIdRange));
+    }
+
+    /// @return Random itemId of specified class in tree. All Items of the
+    /// class are equally likely. See Tree::setItemClassifier().
+    /// NOTE: exclusions (see setExclusionSize()) are not applied.
+    /// @throw Error If there are no Items of this class or class counts are
+    /// out of date (see Tree::itemCount(int)).
+    int randomItemId(const Tree & tree, int itemClass);
+
+    /// @return Absolute path to random Item of specified class in tree.
+    /// @throw Error If there are no Items of this class.
+    std::string randomPath(const Tree & tree, int itemClass) {
+        return tree.getItemAbsolutePath(randomItemId(tree, itemClass));
+    }
+
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @return count random itemIds in the tree (possibly repeating), in the
+    /// order they were chosen.
+    /// @throw Error If count > 0 and there are no Items in the tree.
+    template <class ItemCollection>
+    std::vector<int> randomItemIds(const ItemCollection & tree,
+                                   const std::size_t count) {
+        std::vector<int> itemIds;
+        itemIds.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            itemIds.push_back(randomItemId(tree));
+        return itemIds;
+    }
+
+    /// @tparam ItemCollection FlatTree or MappedTree.
+    /// @return Absolute paths to count next random Items in the tree.
+    /// @throw Error If count > 0 and there are no Items in the tree.
+    template <class ItemCollection>
+    std::vector<std::string> randomPaths(const ItemCollection & tree,
+                                         const std::size_t count) {
+        std::vector<std::string> paths;
+        paths.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            paths.push_back(randomPath(tree));
+        return paths;
+    }
+
+    /// @brief Equivalent to calling randomPath(tree) count times, but
+    /// resolves all paths in a single traversal of tree.
+    /// @throw Error If count > 0 and there are no Items in the tree.
+    std::vector<std::string> randomPaths(const Tree & tree,
+                                         std::size_t count);
+
+    /// @brief Replaces contents of path with absolute path to next random
+    /// Item in the tree without allocating memory if path has enough capacity.
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @throw Error If there are no Items in the tree.
+    template <class ItemCollection>
+    void randomPath(const ItemCollection & tree, std::string & path) {
+        tree.getItemAbsolutePath(randomItemId(tree), path);
+    }
+
+    /// @brief Sets the number of most recently chosen Items that are
+    /// excluded from subsequent choices. 0 (default) disables exclusion.
+    /// NOTE: at most itemCount / 2 Items are excluded, so choosing an Item
+    /// takes less than 2 attempts on average.
+    /// NOTE: exclusions are cleared when the number of Items changes, because
+    /// itemIds are not stable across tree modifications.
+    void setExclusionSize(std::size_t size);
+    std::size_t exclusionSize() const { return exclusionSize_; }
+
+    /// @brief Makes all Items available for choosing again.
+    void clearExclusions();
+
 private:
     typedef std::uniform_int_distribution<int> Distribution;
 
+    /// @return Random itemId in range [0, itemCount).
+    /// @throw Error If itemCount == 0.
+    int randomItemId(int itemCount);
+
     /// NOTE: distribution bounds are determined by tree.itemCount(), which is
     /// not expected to change often. So the distribution is cached.
     /// The primary reason for caching is not performance but possible
@@ -289,12 +880,170 @@ private:
     Distribution distribution_ { 0, 0 };
 
     std::mt19937 engine_;
+
+    std::size_t exclusionSize_ = 0;
+    /// Recently chosen itemIds, the oldest first.
+    std::deque<int> recentItemIds_;
+    /// excluded_[itemId] is true if itemId is in recentItemIds_.
+    std::vector<bool> excluded_;
+};
+
+
+/// @brief Chooses random Items with probabilities proportional to their
+/// weights (e.g. rating or recency penalty).
+/// Weights are stored in a Fenwick tree, so both choosing an Item and changing
+/// a single weight cost O(log(itemCount)). Initializing all weights is O(n).
+/// NOTE: weights are indexed by itemId, so they must be reassigned after
+/// modifying the tree.
+class WeightedItemChooser
+{
+public:
+    typedef RandomItemChooser::Seed Seed;
+
+    /// @brief Constructs random engine using current time as a seed.
+    explicit WeightedItemChooser();
+
+    /// @brief Constructs random engine using parameter value as a seed.
+    explicit WeightedItemChooser(Seed seed);
+
+    /// @brief Assigns weight to all itemCount Items.
+    /// @throw Error If weight is negative or not finite.
+    void assign(int itemCount, double weight = 1.0);
+
+    /// @brief Assigns weights[itemId] to each Item.
+    /// @throw Error If some of weights are negative or not finite.
+    void assign(std::vector<double> weights);
+
+    /// @brief Assigns weight(itemId, absolutePath) to each Item in tree.
+    /// Allows deriving weights from directories, e.g. by path prefix.
+    /// @tparam WeightFunction Callable as double(int, const std::string &).
+    /// @throw Error If some of weights are negative or not finite.
+    template <class WeightFunction>
+    void assign(const Tree & tree, WeightFunction weight) {
+        std::vector<double> weights;
+        weights.reserve(std::size_t(tree.itemCount()));
+        tree.forEachItem([&](const int itemId, const std::string & path) {
+            weights.push_back(weight(itemId, path));
+        });
+        assign(std::move(weights));
+    }
+
+    int itemCount() const { return int(weights_.size()); }
+
+    /// @throw Error If there is no such Item.
+    double weight(int itemId) const;
+
+    /// @brief Changes weight of a single Item in O(log(itemCount)).
+    /// @throw Error If there is no such Item or weight is negative or not
+    /// finite.
+    void setWeight(int itemId, double weight);
+
+    /// @return Sum of all weights.
+    double totalWeight() const;
+
+    /// @return Random itemId, chosen with probability
+    /// weight(itemId) / totalWeight().
+    /// @throw Error If totalWeight() is not positive or overflows.
+    int randomItemId();
+
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree with the same
+    /// Items as were used to assign weights.
+    /// @return Absolute path to next random Item in the tree.
+    /// @throw Error If totalWeight() is not positive or overflows.
+    template <class ItemCollection>
+    std::string randomPath(const ItemCollection & tree) {
+        return tree.getItemAbsolutePath(randomItemId());
+    }
+
+private:
+    /// @brief Builds sums_ from weights_ in O(n).
+    void buildSums();
+
+    std::vector<double> weights_;
+    /// Fenwick tree: sums_[i] (1-based) is the sum of weights of Items
+    /// in (i - lowbit(i), i].
+    std::vector<double> sums_ { 0.0 };
+    /// Greatest power of 2 not exceeding itemCount().
+    std::size_t topBit_ = 0;
+
+    std::mt19937 engine_;
+};
+
+
+/// @brief Plays each Item exactly once in random order, then starts a new
+/// random order. The order is a pseudo-random permutation of
+/// [0, itemCount), produced by a keyed Feistel network with cycle-walking.
+/// So neither a shuffled collection nor a history of chosen Items is stored:
+/// the state is just {key, position}, each choice costs O(1) expected time.
+/// NOTE: if the number of Items changes, a new order starts.
+class ShuffleItemChooser
+{
+public:
+    typedef std::uint64_t Key;
+
+    /// @brief Constructs chooser using current time as a key.
+    explicit ShuffleItemChooser();
+
+    /// @brief Constructs chooser that resumes from the specified state.
+    /// @param key Identifies the order.
+    /// @param position Number of already chosen Items in the current order.
+    explicit ShuffleItemChooser(Key key, std::uint32_t position = 0);
+
+    /// @return State, from which the sequence can be resumed later.
+    Key key() const { return key_; }
+    std::uint32_t position() const { return position_; }
+
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @return Next itemId in the random order.
+    /// @throw Error If there are no Items in the tree.
+    template <class ItemCollection>
+    int nextItemId(const ItemCollection & tree) {
+        return nextItemId(tree.itemCount());
+    }
+
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @return Absolute path to next Item in the random order.
+    /// @throw Error If there are no Items in the tree.
+    template <class ItemCollection>
+    std::string nextPath(const ItemCollection & tree) {
+        return tree.getItemAbsolutePath(nextItemId(tree));
+    }
+
+    /// @brief Replaces contents of path with absolute path to next Item in
+    /// the random order.
+    /// @tparam ItemCollection Tree, FlatTree or MappedTree.
+    /// @throw Error If there are no Items in the tree.
+    template <class ItemCollection>
+    void nextPath(const ItemCollection & tree, std::string & path) {
+        tree.getItemAbsolutePath(nextItemId(tree), path);
+    }
+
+    /// @return itemId at specified position of the order, identified by key,
+    /// over itemCount Items.
+    /// @throw Error If position >= itemCount.
+    static int itemIdAt(Key key, int itemCount, std::uint32_t position);
+
+private:
+    /// @return Next itemId in range [0, itemCount).
+    /// @throw Error If itemCount == 0.
+    int nextItemId(int itemCount);
+
+    Key key_;
+    std::uint32_t position_;
+    /// Number of Items in the current order. Position is reset if it changes.
+    int itemCount_ = -1;
 };
 
 
 /// FOOTNOTES:
 /// 1. Tree::nodesChanged() must be called after calling this method.
 /// 2. Tree::nodesChanged() must be called after modifying tree.
+/// 3. Pointers and references to mutable nodes must not be used for
+///    modification after Tree::nodesChanged() call; they should be obtained
+///    anew via non-const methods. Otherwise Tree::allNodesChanged() must be
+///    called instead of Tree::nodesChanged().
+/// 4. Tree::nodesChanged() must be called after calling this method unless
+///    Tree::isIncrementalCounting() is true.
 
 }
 
@@ -0,0 +1,77 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_MAPPED_TREE_HPP
+# define VENTUROUS_CORE_MAPPED_TREE_HPP
+
+# include <memory>
+# include <string>
+
+
+class QFile;
+
+namespace ItemTree
+{
+class MappableLayout;
+
+/// @brief Read-only tree, which answers queries directly from memory-mapped
+/// file, saved with Tree::Format::mappable. Opening is O(1): nothing is
+/// parsed in advance, so resident memory is proportional to the number of
+/// pages actually touched by queries.
+/// NOTE: if the file is modified while mapped, behavior is undefined.
+/// NOTE: journal of the file (see Journal) is ignored. Journal::checkpoint()
+/// applies it to the file.
+class MappedTree
+{
+public:
+    /// @brief Constructs closed (empty) tree.
+    explicit MappedTree();
+    MappedTree(const MappedTree &) = delete;
+    MappedTree & operator = (const MappedTree &) = delete;
+    ~MappedTree();
+
+    /// @brief Closes previously opened file (if any) and maps filename.
+    /// @return Empty string if mapping was successful. Error message otherwise.
+    /// If error occurs, this tree is closed.
+    std::string open(const std::string & filename);
+
+    /// @brief Unmaps file. After this call the tree is empty.
+    void close();
+
+    bool isOpen() const;
+
+    int itemCount() const;
+
+    /// @param itemId Sequence number of required Item (starting from 0).
+    /// @return Specified Item's absolute path.
+    /// @throw Error If there is no such Item or the file is corrupted.
+    std::string getItemAbsolutePath(int itemId) const;
+
+    /// @brief Replaces contents of path with specified Item's absolute path.
+    /// Reusing the same path buffer for many calls avoids heap allocations.
+    /// @throw Error If there is no such Item.
+    void getItemAbsolutePath(int itemId, std::string & path) const;
+
+private:
+    std::unique_ptr<QFile> file_;
+    std::unique_ptr<MappableLayout> layout_;
+};
+
+}
+
+# endif // VENTUROUS_CORE_MAPPED_TREE_HPP
@@ -0,0 +1,70 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_TREE_BUILDER_HPP
+# define VENTUROUS_CORE_TREE_BUILDER_HPP
+
+# include "ItemTree.hpp"
+
+# include <cstddef>
+# include <utility>
+# include <vector>
+# include <string>
+
+
+namespace ItemTree
+{
+/// @brief Collects Item paths and builds Tree from all of them at once.
+/// Unlike a series of Tree::insertItem() calls, which shift nodes in wide
+/// directories on every insertion, build() sorts the paths (in parallel on
+/// large inputs) and then appends every node to its parent in a single linear
+/// pass.
+class TreeBuilder
+{
+public:
+    explicit TreeBuilder() = default;
+
+    /// @brief Adds path to a future Item. Paths may be added in any order;
+    /// duplicates are allowed.
+    void addItem(std::string absolutePath) {
+        paths_.emplace_back(std::move(absolutePath));
+    }
+
+    template <typename InputStringIterator>
+    void addItems(InputStringIterator begin, const InputStringIterator end) {
+        for (; begin != end; ++begin)
+            paths_.emplace_back(* begin);
+    }
+
+    /// @return Number of paths added since the last build() call.
+    std::size_t pathCount() const { return paths_.size(); }
+
+    /// @return Tree that contains all added paths as Items.
+    /// Tree::nodesChanged() has already been called for it.
+    /// Added paths are cleared.
+    /// @throw Error If some path ends with '/'. In this case added paths are
+    /// cleared too.
+    Tree build();
+
+private:
+    std::vector<std::string> paths_;
+};
+
+}
+
+# endif // VENTUROUS_CORE_TREE_BUILDER_HPP
@@ -25,6 +25,7 @@
 # include "AddingItems.hpp"
 
 # include "ItemTree.hpp"
+# include "TreeBuilder.hpp"
 
 # include <QtCoreUtilities/String.hpp>
 
@@ -35,7 +36,9 @@
 # include <cstddef>
 # include <utility>
 # include <algorithm>
+# include <vector>
 # include <string>
+# include <functional>
 
 
 namespace AddingItems
@@ -54,18 +57,21 @@ namespace
 class ItemAdder
 {
 public:
+    /// Receives absolute path of each found item.
+    typedef std::function<void (std::string)> InsertItem;
+
     explicit ItemAdder(const QString & dirName, const Patterns & patterns,
-                       const Policy & policy, ItemTree::Tree & itemTree);
+                       const Policy & policy, InsertItem insertItem);
 
     void addItems();
 
 private:
     typedef void (ItemAdder::*AddMethod)();
 
-    /// @brief Recursively adds items from dir_ to itemTree_. Starts with adding
+    /// @brief Recursively adds items from dir_ to the tree. Starts with adding
     /// files, then considers adding media dirs.
     void addFilesFirst();
-    /// @brief Recursively adds items from dir_ to itemTree_. Considers adding
+    /// @brief Recursively adds items from dir_ to the tree. Considers adding
     /// media dirs first; if some dir isn't media dir, considers adding files
     /// from it.
     void addMediaDirFirst();
@@ -74,10 +80,10 @@ private:
     QStringList getFileList() const;
     /// @return true if dir_ is media dir.
     bool isMediaDir() const;
-    /// @brief Adds all suitable files from dir_ to itemTree_.
+    /// @brief Adds all suitable files from dir_ to the tree.
     /// @return true if at least one file was added.
     bool addFiles();
-    /// @brief Adds dir_ to itemTree_.
+    /// @brief Adds dir_ to the tree.
     void addMediaDir();
 
     /// @brief Enters dir_'s subdirectory named subdirName;
@@ -94,14 +100,15 @@ private:
 
     const Patterns & patterns_;
     const Policy & policy_;
-    ItemTree::Tree & itemTree_;
+    /// Inserts items in the target tree or tree builder.
+    const InsertItem insertItem_;
 };
 
 
 ItemAdder::ItemAdder(const QString & dirName, const Patterns & patterns,
-                     const Policy & policy, ItemTree::Tree & itemTree)
+                     const Policy & policy, InsertItem insertItem)
     : dir_(dirName), curPath_(QtUtilities::qStringToString(dir_.path())),
-      patterns_(patterns), policy_(policy), itemTree_(itemTree)
+      patterns_(patterns), policy_(policy), insertItem_(std::move(insertItem))
 {
     dir_.setFilter(QDir::Files | QDir::Readable | QDir::Hidden);
     if (policy_.addMediaDirs)
@@ -168,8 +175,7 @@ bool ItemAdder::addFiles()
 
     std::for_each(items.begin(), items.end(),
     [this](const QString & filename) {
-        itemTree_.insertItem(curPath_ + '/' +
-                             QtUtilities::qStringToString(filename));
+        insertItem_(curPath_ + '/' + QtUtilities::qStringToString(filename));
 
 # ifdef DEBUG_VENTUROUS_ADDING_ITEMS
         std::cout << "Added file "
@@ -182,7 +188,7 @@ bool ItemAdder::addFiles()
 
 void ItemAdder::addMediaDir()
 {
-    itemTree_.insertItem(curPath_);
+    insertItem_(curPath_);
 
 # ifdef DEBUG_VENTUROUS_ADDING_ITEMS
     std::cout << "Added media dir." << std::endl;
@@ -225,8 +231,44 @@ void addDir(const QString & dirName, const Patterns & patterns,
     if (! policy.addFiles && ! policy.addMediaDirs)
         return;
 
-    ItemAdder adder(dirName, patterns, policy, itemTree);
+    ItemAdder adder(dirName, patterns, policy,
+    [&itemTree](std::string path) {
+        itemTree.insertItem(std::move(path));
+    });
     adder.addItems();
 }
 
+void addDir(const QString & dirName, const Patterns & patterns,
+            const Policy & policy, ItemTree::TreeBuilder & treeBuilder)
+{
+    if (! policy.addFiles && ! policy.addMediaDirs)
+        return;
+
+    ItemAdder adder(dirName, patterns, policy,
+    [&treeBuilder](std::string path) {
+        treeBuilder.addItem(std::move(path));
+    });
+    adder.addItems();
+}
+
+
+std::function<int (const ItemTree::Node &)> patternClassifier(
+    const std::vector<QStringList> & patternsPerClass)
+{
+    const QString extensionPrefix = "*.";
+    std::vector<std::vector<std::string>> extensionsPerClass;
+    for (const QStringList & patterns : patternsPerClass) {
+        extensionsPerClass.emplace_back();
+        for (const QString & pattern : patterns) {
+            const QString extension = pattern.mid(extensionPrefix.size());
+            if (pattern.startsWith(extensionPrefix) && ! extension.isEmpty() &&
+                    ! extension.contains('*') && ! extension.contains('?')) {
+                extensionsPerClass.back().push_back(
+                    QtUtilities::qStringToString(extension));
+            }
+        }
+    }
+    return ItemTree::extensionClassifier(extensionsPerClass);
+}
+
 }
@@ -0,0 +1,215 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_CONCURRENCY_HPP
+# define VENTUROUS_CORE_CONCURRENCY_HPP
+
+# include <cstddef>
+# include <iterator>
+# include <algorithm>
+# include <vector>
+# include <atomic>
+# include <exception>
+# include <mutex>
+# include <condition_variable>
+# include <thread>
+
+
+namespace Concurrency
+{
+/// @return Number of threads that can run concurrently on this system
+/// (at least 1).
+inline std::size_t hardwareThreadCount()
+{
+    const unsigned count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+/// @brief Calls function(i) for each i in [0, count). Indices are handed out
+/// dynamically to up to maxThreadCount threads (including the calling
+/// thread), so tasks of uneven size are balanced.
+/// If some call throws, remaining tasks are not started and the first
+/// exception is rethrown in the calling thread after all threads finish.
+/// @param maxThreadCount Pass 1 if the tasks are too small to be worth
+/// starting threads.
+/// NOTE: function must be safe to call concurrently for different indices.
+template <typename Function>
+void parallelFor(const std::size_t count, const Function & function,
+                 const std::size_t maxThreadCount = hardwareThreadCount())
+{
+    const std::size_t threadCount = std::min(count, maxThreadCount);
+    if (threadCount <= 1) {
+        for (std::size_t i = 0; i < count; ++i)
+            function(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    const auto work = [&] {
+        for (std::size_t i; (i = next++) < count;) {
+            try {
+                function(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (error == nullptr)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount - 1);
+    for (std::size_t i = 1; i < threadCount; ++i)
+        threads.emplace_back(work);
+    work();
+    for (std::thread & thread : threads)
+        thread.join();
+    if (error != nullptr)
+        std::rethrow_exception(error);
+}
+
+/// @brief Calls produce(i, buffer) for each i in [0, count) concurrently,
+/// like parallelFor(), and consume(i, buffer) for each i in increasing order,
+/// as soon as produce(i, buffer) and all preceding calls of consume() return.
+/// At most two buffers per thread exist at a time: they are reused for next
+/// indices after being consumed, so produce() must reset buffer.
+/// Calls of consume() do not overlap, but can be made in any of the threads.
+/// If some call throws, remaining tasks are not started and the first
+/// exception is rethrown in the calling thread after all threads finish.
+template <typename Buffer, typename Produce, typename Consume>
+void orderedParallelFor(const std::size_t count, const Produce & produce,
+                        const Consume & consume)
+{
+    const std::size_t threadCount = std::min(count, hardwareThreadCount());
+    if (threadCount <= 1) {
+        Buffer buffer;
+        for (std::size_t i = 0; i < count; ++i) {
+            produce(i, buffer);
+            consume(i, buffer);
+        }
+        return;
+    }
+
+    const std::size_t window = 2 * threadCount;
+    std::vector<Buffer> buffers(window);
+    std::vector<char> produced(window, false);
+    std::size_t next = 0, consumed = 0;
+    bool consuming = false;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable bufferFreed;
+    const auto work = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bufferFreed.wait(lock, [&] {
+                return next == count || error != nullptr ||
+                       next < consumed + window;
+            });
+            if (next == count || error != nullptr)
+                return;
+            const std::size_t i = next++;
+            lock.unlock();
+            bool isConsumer = false;
+            try {
+                produce(i, buffers[i % window]);
+                lock.lock();
+                produced[i % window] = true;
+                // The thread that finds the next buffer to be consumed ready
+                // consumes it and all buffers produced meanwhile.
+                if (consuming)
+                    continue;
+                consuming = isConsumer = true;
+                while (error == nullptr && consumed < count &&
+                        produced[consumed % window]) {
+                    lock.unlock();
+                    consume(consumed, buffers[consumed % window]);
+                    lock.lock();
+                    produced[consumed % window] = false;
+                    ++consumed;
+                    bufferFreed.notify_all();
+                }
+                consuming = false;
+            }
+            catch (...) {
+                if (! lock.owns_lock())
+                    lock.lock();
+                if (error == nullptr)
+                    error = std::current_exception();
+                if (isConsumer)
+                    consuming = false;
+                bufferFreed.notify_all();
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount - 1);
+    for (std::size_t i = 1; i < threadCount; ++i)
+        threads.emplace_back(work);
+    work();
+    for (std::thread & thread : threads)
+        thread.join();
+    if (error != nullptr)
+        std::rethrow_exception(error);
+}
+
+/// @brief Sorts [begin, end) by sorting equal chunks concurrently and merging
+/// them pairwise, also concurrently.
+template <typename RandomIt, typename Compare>
+void parallelSort(const RandomIt begin, const RandomIt end,
+                  const Compare & compare)
+{
+    typedef typename std::iterator_traits<RandomIt>::difference_type Distance;
+    // Sorting small ranges in a single thread is faster.
+    constexpr Distance minChunkSize = 1 << 14;
+    const Distance size = end - begin;
+    const std::size_t chunkCount = std::max<std::size_t>(
+        1, std::min(hardwareThreadCount(), std::size_t(size / minChunkSize)));
+    if (chunkCount == 1) {
+        std::sort(begin, end, compare);
+        return;
+    }
+
+    std::vector<RandomIt> bounds;
+    for (std::size_t i = 0; i < chunkCount; ++i)
+        bounds.emplace_back(begin + Distance(i) * size / Distance(chunkCount));
+    bounds.emplace_back(end);
+
+    parallelFor(chunkCount, [&](const std::size_t i) {
+        std::sort(bounds[i], bounds[i + 1], compare);
+    });
+    for (std::size_t step = 1; step < chunkCount; step *= 2) {
+        const std::size_t mergeCount = (chunkCount - step + 2 * step - 1) /
+                                       (2 * step);
+        parallelFor(mergeCount, [&](const std::size_t i) {
+            const std::size_t first = 2 * step * i;
+            const std::size_t last = std::min(first + 2 * step, chunkCount);
+            std::inplace_merge(bounds[first], bounds[first + step],
+                               bounds[last], compare);
+        });
+    }
+}
+
+}
+
+# endif // VENTUROUS_CORE_CONCURRENCY_HPP
@@ -0,0 +1,218 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# include "FlatTree.hpp"
+
+# include "ItemTree.hpp"
+# include "MappableLayout.hpp"
+
+# include <CommonUtilities/Streams.hpp>
+
+# include <cstddef>
+# include <cstdint>
+# include <algorithm>
+# include <vector>
+# include <string>
+# include <fstream>
+
+
+namespace ItemTree
+{
+FlatTree::FlatTree()
+{
+    clear();
+}
+
+FlatTree::FlatTree(const Tree & tree)
+{
+    assign(tree);
+}
+
+void FlatTree::assign(const Tree & tree)
+{
+    clear();
+    accumulatedItemCounts_.front() = tree.itemCount();
+
+    /// Holds nodes in breadth-first order. Index of node in this collection
+    /// is one less than its index in this tree because root is not stored.
+    std::vector<const Node *> nodes;
+    const auto addChildren = [this, & tree, & nodes](
+    const std::uint32_t parent, const Node * const parentNode) {
+        const std::vector<Node> & children =
+            parentNode == nullptr ? tree.topLevelNodes()
+            : parentNode->children();
+        firstChildren_[parent] = nodeCount();
+        childCounts_[parent] = static_cast<std::uint32_t>(children.size());
+
+        int precedingCount =
+            (parentNode != nullptr && parentNode->isPlayable()) ? 1 : 0;
+        for (const Node & child : children) {
+            nodes.emplace_back(& child);
+            names_ += child.name();
+            nameOffsets_.emplace_back(std::uint32_t(names_.size()));
+            firstChildren_.emplace_back(0);
+            childCounts_.emplace_back(0);
+            precedingCount += child.itemCount();
+            accumulatedItemCounts_.emplace_back(precedingCount);
+            playable_.push_back(child.isPlayable());
+        }
+    };
+
+    addChildren(0, nullptr);
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+        addChildren(std::uint32_t(i + 1), nodes[i]);
+}
+
+std::string FlatTree::load(const std::string & filename)
+{
+    {
+        std::ifstream is(filename, std::ios::binary);
+        char header[MappableLayout::magicSize];
+        is.read(header, MappableLayout::magicSize);
+        // Tree::load() replays the journal if there is one.
+        if (MappableLayout::hasMagic(header, std::size_t(is.gcount())) &&
+                ! std::ifstream(Journal::filename(filename))) {
+            is.seekg(0, std::ios::end);
+            const std::streamoff fileSize = is.tellg();
+            std::string data(static_cast<std::size_t>(fileSize), '\0');
+            is.seekg(0);
+            if (! is.read(& data[0], fileSize)) {
+                clear();
+                return "reading file \"" + filename + "\" failed.";
+            }
+            return loadMappable(data.data(), data.size());
+        }
+    }
+
+    Tree tree;
+    const std::string error = tree.load(filename);
+    if (! error.empty()) {
+        clear();
+        return error;
+    }
+    tree.nodesChanged();
+    assign(tree);
+    return std::string();
+}
+
+bool FlatTree::save(const std::string & filename) const
+{
+    const std::size_t recordsOffset = MappableLayout::headerSize;
+    const std::size_t namesOffset =
+        recordsOffset + nodeCount() * MappableLayout::recordSize;
+    std::string buffer(namesOffset + names_.size(), '\0');
+    std::copy(MappableLayout::magic,
+              MappableLayout::magic + MappableLayout::magicSize,
+              buffer.begin());
+    char * const header = & buffer[MappableLayout::magicSize];
+    LittleEndian::writeUint32(header, MappableLayout::version);
+    LittleEndian::writeUint32(header + 4, nodeCount());
+    LittleEndian::writeUint32(header + 8, std::uint32_t(names_.size()));
+
+    char * record = & buffer[recordsOffset];
+    for (std::uint32_t node = 0; node < nodeCount(); ++node) {
+        LittleEndian::writeUint32(record, nameOffsets_[node]);
+        LittleEndian::writeUint32(
+            record + 4, nameSize(node) |
+            (isPlayable(node) ? MappableLayout::playableBit : 0));
+        LittleEndian::writeUint32(record + 8, firstChild(node));
+        LittleEndian::writeUint32(record + 12, childCount(node));
+        LittleEndian::writeUint32(
+            record + 16, std::uint32_t(accumulatedItemCount(node)));
+        record += MappableLayout::recordSize;
+    }
+    std::copy(names_.begin(), names_.end(), buffer.begin() + namesOffset);
+
+    std::ofstream os(filename, std::ios::binary);
+    os.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    os.close();
+    return CommonUtilities::isStreamFine(os);
+}
+
+std::string FlatTree::getItemAbsolutePath(const int itemId) const
+{
+    std::string path;
+    getItemAbsolutePath(itemId, path);
+    return path;
+}
+
+void FlatTree::getItemAbsolutePath(const int itemId, std::string & path) const
+{
+    path.clear();
+    appendFlatItemPath(* this, itemId, path);
+}
+
+void FlatTree::clear()
+{
+    names_.clear();
+    nameOffsets_.assign(2, 0);
+    firstChildren_.assign(1, 1);
+    childCounts_.assign(1, 0);
+    accumulatedItemCounts_.assign(1, 0);
+    playable_.assign(1, false);
+}
+
+std::string FlatTree::loadMappable(const char * const data,
+                                   const std::size_t size)
+{
+    MappableLayout layout;
+    const std::string error = layout.reset(data, size);
+    if (! error.empty()) {
+        clear();
+        return error;
+    }
+
+    const std::uint32_t count = layout.nodeCount();
+    names_.clear();
+    nameOffsets_.assign(1, 0);
+    firstChildren_.resize(count);
+    childCounts_.resize(count);
+    accumulatedItemCounts_.resize(count);
+    playable_.resize(count);
+    try {
+        // Children of each node must immediately follow children of the
+        // previous node. This guarantees that every node has exactly one
+        // parent.
+        std::uint32_t nextChild = 1;
+        for (std::uint32_t node = 0; node < count; ++node) {
+            layout.checkName(node);
+            layout.checkChildren(node);
+            const std::uint32_t first = layout.firstChild(node);
+            const std::uint32_t children = layout.childCount(node);
+            if (children != 0 && first != nextChild)
+                throw Error("mapped tree is corrupted.");
+            nextChild += children;
+
+            names_.append(layout.name(node), layout.nameSize(node));
+            nameOffsets_.emplace_back(std::uint32_t(names_.size()));
+            firstChildren_[node] = first;
+            childCounts_[node] = children;
+            accumulatedItemCounts_[node] = layout.accumulatedItemCount(node);
+            playable_[node] = layout.isPlayable(node);
+        }
+        if (nextChild != count)
+            throw Error("mapped tree is corrupted.");
+    }
+    catch (const Error & e) {
+        clear();
+        return e.what();
+    }
+    return std::string();
+}
+
+}
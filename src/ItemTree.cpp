@@ -17,17 +17,34 @@
 */
 
 # include "ItemTree.hpp"
+# include "ItemTree-inl.hpp"
+
+# include "Concurrency.hpp"
+# include "FlatTree.hpp"
+# include "MappableLayout.hpp"
+# include "NamePool.hpp"
 
 # include <CommonUtilities/Streams.hpp>
 
 # include <cstddef>
+# include <cstdint>
 # include <cassert>
+# include <cstring>
+# include <cstdio>
+# include <cmath>
+# include <limits>
 # include <utility>
 # include <functional>
 # include <algorithm>
 # include <vector>
 # include <string>
+# include <unordered_map>
+# include <memory>
 # include <chrono>
+# include <thread>
+# include <mutex>
+# include <condition_variable>
+# include <system_error>
 # include <fstream>
 
 
@@ -51,17 +68,44 @@ struct EqualNodeNames {
 // {systems with root directory '/'}. Other nodes' names don't contain '/'.
 
 constexpr char unplayableSymbol = '-', itemSymbol = '*', indentSymbol = '\t';
-/// @brief Prints node and all its descendants to os.
+/// @brief Appends line of node in text format to buffer.
 /// @param indent Determines level of node.
-void print(std::ostream & os, const Node & node, int indent = 0)
+void appendTextLine(std::string & buffer, const Node & node,
+                    const std::size_t indent)
+{
+    buffer.append(indent, indentSymbol);
+    buffer += node.isPlayable() ? itemSymbol : unplayableSymbol;
+    buffer += node.name();
+    buffer += '\n';
+}
+
+/// @brief Appends node and all its descendants to buffer in text format.
+void appendText(std::string & buffer, const Node & node,
+                const std::size_t indent)
 {
-    for (int i = 0; i < indent; ++i)
-        os << indentSymbol;
-    os << (node.isPlayable() ? itemSymbol : unplayableSymbol)
-       << node.name() << '\n';
-    ++indent;
+    appendTextLine(buffer, node, indent);
     for (const Node & child : node.children())
-        print(os, child, indent);
+        appendText(buffer, child, indent + 1);
+}
+
+/// @brief Reads the whole file at once, which is much faster than reading
+/// it line by line.
+/// @return true if reading was successful.
+bool readFile(const std::string & filename, std::string & data)
+{
+    std::ifstream is(filename, std::ios::binary);
+    is.seekg(0, std::ios::end);
+    const std::streamoff fileSize = is.tellg();
+    if (! is || fileSize < 0)
+        return false;
+    data.assign(static_cast<std::size_t>(fileSize), '\0');
+    is.seekg(0);
+    return fileSize == 0 || is.read(& data[0], fileSize);
+}
+
+std::string readingFailedMessage(const std::string & filename)
+{
+    return "reading file \"" + filename + "\" failed.";
 }
 
 std::string invalidStateMessage(const std::string & name)
@@ -74,6 +118,176 @@ std::string wrongFileFormatMessage()
     return "wrong file format.";
 }
 
+
+/// @return Initial slot of nameId in Node::ChildTables::index with specified
+/// mask.
+std::size_t childIndexSlot(const std::uint32_t nameId, const std::size_t mask)
+{
+    // Fibonacci hashing: high bits of the product are well mixed.
+    return std::size_t((std::uint64_t(nameId) * 0x9E3779B97F4A7C15ULL) >> 32)
+           & mask;
+}
+
+/// Processing fewer nodes or Items in the calling thread is faster than
+/// starting other threads.
+constexpr std::size_t minParallelWork = 1 << 14;
+
+/// @brief Decrements budget for node and, if isTask(node) returns true, for
+/// each node in its children's subtrees, visited in the same way.
+/// @return true if budget was exhausted before visiting all these nodes.
+template <class IsTask>
+bool exhaustsBudget(const Node & node, const IsTask & isTask,
+                    std::size_t & budget)
+{
+    if (budget == 0)
+        return true;
+    --budget;
+    if (isTask(node)) {
+        for (const Node & child : node.children()) {
+            if (exhaustsBudget(child, isTask, budget))
+                return true;
+        }
+    }
+    return false;
+}
+
+
+/// Binary format: header (magic + version), then all nodes, starting with
+/// root, in pre-order. Each node is stored as
+/// {playable flag (1 byte), name size, name, child count,
+/// accumulatedItemCount_}. All integers are 32-bit little-endian.
+namespace Binary
+{
+/// Starts with '\0', which can never be the first symbol of a file in text
+/// format, so formats are distinguished reliably.
+constexpr char magic[] = { '\0', 'V', 'C', 'T', 'r', 'e', 'e', '\n' };
+constexpr std::size_t magicSize = sizeof(magic);
+constexpr std::uint32_t version = 1;
+constexpr std::size_t headerSize = magicSize + 4;
+
+using LittleEndian::appendUint32;
+
+/// @throw Error If there are not enough bytes in [pos, end).
+std::uint32_t readUint32(const char * & pos, const char * const end)
+{
+    if (end - pos < 4)
+        throw Error(wrongFileFormatMessage() + " Unexpected end of file.");
+    const std::uint32_t value = LittleEndian::readUint32(pos);
+    pos += 4;
+    return value;
+}
+
+/// @throw Error If value does not fit in int.
+int readInt(const char * & pos, const char * const end)
+{
+    const std::uint32_t value = readUint32(pos, end);
+    if (value > std::uint32_t(std::numeric_limits<int>::max()))
+        throw Error(wrongFileFormatMessage() + " Too large number.");
+    return static_cast<int>(value);
+}
+
+} // END namespace Binary
+
+
+/// @return Well-mixed bits of value (SplitMix64 finalizer). This function
+/// is a bijection.
+std::uint64_t mix(std::uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+
+namespace Shuffle
+{
+constexpr int roundCount = 4;
+
+/// @brief Advances state and returns next SplitMix64 value.
+std::uint64_t splitMix(std::uint64_t & state)
+{
+    state += 0x9E3779B97F4A7C15ULL;
+    return mix(state);
+}
+
+} // END namespace Shuffle
+
+
+/// Destroys nodes, passed to it, in a single background thread. The thread
+/// is started on first use and is joined when the program exits.
+class NodeReclaimer
+{
+public:
+    static NodeReclaimer & instance() {
+        static NodeReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    /// @brief Destroys the remaining nodes and joins the thread.
+    ~NodeReclaimer();
+
+    /// @brief Queues nodes for destruction in the background thread.
+    /// @return true on success. false if the thread could not be started,
+    /// in which case nodes are left intact.
+    bool reclaim(std::unique_ptr<std::vector<Node>> & nodes);
+
+private:
+    NodeReclaimer() = default;
+
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable wakeUp_;
+    std::vector<std::unique_ptr<std::vector<Node>>> queue_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+NodeReclaimer::~NodeReclaimer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeUp_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+bool NodeReclaimer::reclaim(std::unique_ptr<std::vector<Node>> & nodes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (! thread_.joinable()) {
+            try {
+                thread_ = std::thread(& NodeReclaimer::run, this);
+            }
+            catch (const std::system_error &) {
+                return false;
+            }
+        }
+        queue_.push_back(std::move(nodes));
+    }
+    wakeUp_.notify_one();
+    return true;
+}
+
+void NodeReclaimer::run()
+{
+    std::vector<std::unique_ptr<std::vector<Node>>> garbage;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wakeUp_.wait(lock, [this] { return stopping_ || ! queue_.empty(); });
+        if (queue_.empty())
+            return;
+        garbage.swap(queue_);
+        lock.unlock();
+        // Destroying nodes is the slow part, it is done without the lock.
+        garbage.clear();
+        lock.lock();
+    }
+}
+
 } // END unnamed namespace
 
 
@@ -81,102 +295,563 @@ std::string wrongFileFormatMessage()
 Error::~Error() noexcept = default;
 
 
+ItemClassifier extensionClassifier(
+    const std::vector<std::vector<std::string>> & extensionsPerClass)
+{
+    typedef std::unordered_map<std::string, int> ClassMap;
+    const auto lowerCase = [](std::string & s) {
+        for (char & c : s) {
+            if (c >= 'A' && c <= 'Z')
+                c = char(c - 'A' + 'a');
+        }
+    };
+    // Shared and never modified after construction, so the classifier is
+    // thread-safe.
+    const std::shared_ptr<ClassMap> classes = std::make_shared<ClassMap>();
+    for (std::size_t c = 0; c < extensionsPerClass.size(); ++c) {
+        for (std::string extension : extensionsPerClass[c]) {
+            lowerCase(extension);
+            classes->emplace(std::move(extension), int(c));
+        }
+    }
+    return [classes, lowerCase](const Node & node) {
+        const std::string & name = node.name();
+        const std::size_t dot = name.rfind('.');
+        if (dot == std::string::npos)
+            return -1;
+        std::string extension = name.substr(dot + 1);
+        lowerCase(extension);
+        const auto it = classes->find(extension);
+        return it == classes->end() ? -1 : it->second;
+    };
+}
+
+
 int Node::itemCount() const
 {
     return children_.empty() ? (playable_ ? 1 : 0)
                : children_.back().accumulatedItemCount_;
 }
 
-Node * Node::child(const std::string & name)
+const std::string & Node::name() const
 {
-    const auto range = std::equal_range(
-                           children_.begin(), children_.end(),
-                           Node(name, false), CompareNodesByName());
-    if (range.first == range.second)
-        return nullptr;
-    return & *range.first;
+    return NamePool::instance().name(nameId_);
 }
 
+Node * Node::child(const char * const name, const std::size_t nameSize)
+{
+    // The returned child may be modified.
+    dirty_ = true;
+    const auto it = findChild(name, nameSize);
+    return it == children_.end() ? nullptr : & * it;
+}
 
-Node::Node(std::string name, const bool playable)
-    : name_(std::move(name)), playable_(playable)
+const Node * Node::child(const char * const name,
+                         const std::size_t nameSize) const
 {
+    const auto it = findChild(name, nameSize);
+    return it == children_.cend() ? nullptr : & * it;
 }
 
-std::string Node::getRelativeChildItemPath(int relativeId) const
+
+Node::Node(const Node & other)
+    : nameId_(other.nameId_), playable_(other.playable_), dirty_(other.dirty_),
+      itemClass_(other.itemClass_),
+      accumulatedItemCount_(other.accumulatedItemCount_), hash_(other.hash_),
+      children_(other.children_),
+      childTables_(other.childTables_ == nullptr ? nullptr :
+                   new ChildTables(* other.childTables_))
 {
-    if (relativeId == 0 && playable_)
-        return std::string();
+}
 
-    std::vector<Node>::const_iterator it;
-    {
-        Node fake(std::string(), false);
-        fake.accumulatedItemCount_ = relativeId;
+Node & Node::operator = (const Node & other)
+{
+    if (this != & other)
+        * this = Node(other);
+    return * this;
+}
+
+Node::Node(const std::string & name, const bool playable)
+    : Node(name.data(), name.size(), playable)
+{
+}
+
+Node::Node(const char * const name, const std::size_t nameSize,
+           const bool playable)
+    : nameId_(NamePool::instance().intern(name, nameSize)), playable_(playable)
+{
+}
+
+Node::Node(const std::uint32_t nameId, const bool playable)
+    : nameId_(nameId), playable_(playable)
+{
+}
+
+void Node::appendRelativeItemPath(int relativeId, std::string & path) const
+{
+    const Node * node = this;
+    while (relativeId != 0 || ! node->playable_) {
         // Find a child that contains (or is itself) the necessary Item.
-        it = std::upper_bound(children_.cbegin(), children_.cend(), fake,
-                              [](const Node & lhs, const Node & rhs)
-        { return lhs.accumulatedItemCount_ < rhs.accumulatedItemCount_; });
+        const auto it = std::upper_bound(
+                            node->children_.cbegin(), node->children_.cend(),
+                            relativeId,
+        [](const int id, const Node & child) {
+            return id < child.accumulatedItemCount_;
+        });
+
+        if (it == node->children_.cend())
+            throw Error("no such child.");
+        if (it == node->children_.cbegin()) {
+            if (node->playable_)
+                --relativeId;
+        }
+        else
+            relativeId -= (it - 1)->accumulatedItemCount_;
+
+        node = & * it;
+        path += node->name();
+        path += '/';
+    }
+}
+
+std::vector<Node>::iterator Node::findChild(const char * const name,
+        const std::size_t nameSize)
+{
+    const Node & constThis = * this;
+    return children_.begin() +
+           (constThis.findChild(name, nameSize) - children_.cbegin());
+}
+
+std::vector<Node>::const_iterator Node::findChild(const char * const name,
+        const std::size_t nameSize) const
+{
+    if (childTables_ != nullptr && ! childTables_->index.empty()) {
+        // If name is not in the pool, no node has such name.
+        const NamePool::Id id = NamePool::instance().find(name, nameSize);
+        if (id == NamePool::invalidId())
+            return children_.cend();
+        const std::vector<std::uint32_t> & index = childTables_->index;
+        const std::size_t mask = index.size() - 1;
+        for (std::size_t slot = childIndexSlot(id, mask); ;
+                slot = (slot + 1) & mask) {
+            const std::uint32_t entry = index[slot];
+            if (entry == 0)
+                return children_.cend();
+            if (children_[entry - 1].nameId_ == id)
+                return children_.cbegin() + std::ptrdiff_t(entry - 1);
+        }
+    }
+    const auto it = std::lower_bound(
+                        children_.cbegin(), children_.cend(), nameSize,
+    [name](const Node & node, const std::size_t size) {
+        return node.name().compare(0, std::string::npos, name, size) < 0;
+    });
+    // Comparing strings is cheaper than hashing name to find its id.
+    if (it == children_.cend() ||
+            it->name().compare(0, std::string::npos, name, nameSize) != 0) {
+        return children_.cend();
     }
+    return it;
+}
 
-    if (it == children_.cend())
-        throw Error("no such child.");
-    if (it == children_.cbegin()) {
-        if (playable_)
-            --relativeId;
+void Node::buildChildIndex()
+{
+    if (children_.size() < childIndexThreshold) {
+        clearChildIndex();
+        return;
+    }
+    if (childTables_ == nullptr)
+        childTables_.reset(new ChildTables);
+    std::vector<std::uint32_t> & index = childTables_->index;
+    // Load factor does not exceed 1/2.
+    std::size_t size = 1;
+    while (size < 2 * children_.size())
+        size *= 2;
+    index.assign(size, 0);
+    const std::size_t mask = size - 1;
+    for (std::size_t i = 0; i < children_.size(); ++i) {
+        std::size_t slot = childIndexSlot(children_[i].nameId_, mask);
+        while (index[slot] != 0)
+            slot = (slot + 1) & mask;
+        index[slot] = static_cast<std::uint32_t>(i + 1);
     }
-    else
-        relativeId -= (it - 1)->accumulatedItemCount_;
-    return it->getChildItemPath(relativeId);
 }
 
-std::string Node::getChildItemPath(const int relativeId) const
+void Node::clearChildIndex()
 {
-    return name_ + '/' + getRelativeChildItemPath(relativeId);
+    if (childTables_ != nullptr) {
+        childTables_->index.clear();
+        releaseEmptyChildTables();
+    }
 }
 
-void Node::insertItem(std::string relativePath)
+void Node::releaseEmptyChildTables()
+{
+    if (childTables_->classCounts.empty() && childTables_->index.empty())
+        childTables_.reset();
+}
+
+int Node::insertItem(const std::string & path, const std::size_t begin,
+                     const bool updateCounts)
 {
     // Skipping first symbol because root can have '/' as its first symbol.
     // Empty names are not allowed, so this is fine.
-    const std::size_t separatorPos = relativePath.find('/', 1);
-    std::string firstDir, residue;
-    if (separatorPos == std::string::npos)
-        firstDir = std::move(relativePath);
-    else {
-        firstDir = relativePath.substr(0, separatorPos);
+    const std::size_t end = std::min(path.find('/', begin + 1), path.size());
+    if (end + 1 == path.size())
+        throw Error("path ends with '/'.");
+
+    dirty_ = true;
+    auto it = findChild(path.data() + begin, end - begin);
+    if (it == children_.end()) {
+        Node newNode(path.data() + begin, end - begin, false);
+        it = std::lower_bound(children_.begin(), children_.end(), newNode,
+                              CompareNodesByName());
+        // New node has no Items yet.
+        newNode.accumulatedItemCount_ =
+            it == children_.begin() ? (playable_ ? 1 : 0)
+            : (it - 1)->accumulatedItemCount_;
+        it = children_.insert(it, std::move(newNode));
+        clearChildIndex();
+    }
+
+    int delta = 0;
+    // This node is playable if it is at the end of inserted path.
+    if (end == path.size()) {
+        if (! it->playable_) {
+            it->playable_ = true;
+            it->dirty_ = true;
+            delta = 1;
+            if (updateCounts)
+                it->shiftChildrenCounts(delta);
+        }
+    }
+    else
         // Skipping separator '/'.
-        residue = std::move(relativePath).substr(separatorPos + 1);
-        if (residue.empty())
-            throw Error("path ends with '/'.");
+        delta = it->insertItem(path, end + 1, updateCounts);
+
+    if (updateCounts && delta != 0) {
+        for (auto sibling = it; sibling != children_.end(); ++sibling)
+            sibling->accumulatedItemCount_ += delta;
     }
+    return delta;
+}
 
-    // This node is playable if it is at the end of inserted path, which is
-    // equivalent to (residue.empty() == true).
-    Node newNode(std::move(firstDir), residue.empty());
-    auto range = std::equal_range(children_.begin(), children_.end(),
-                                  newNode, CompareNodesByName());
+int Node::removeItem(const std::string & path, const std::size_t begin,
+                     const bool updateCounts)
+{
+    // Path is split into names exactly as in insertItem().
+    const std::size_t end = std::min(path.find('/', begin + 1), path.size());
+    if (end + 1 == path.size())
+        throw Error("path ends with '/'.");
+    const auto it = findChild(path.data() + begin, end - begin);
+    if (it == children_.end())
+        return 0;
 
-    if (range.first == range.second)
-        range.first = children_.insert(range.first, newNode);
-    else if (newNode.playable_)
-        range.first->playable_ = true;
+    dirty_ = true;
+    int delta = 0;
+    if (end == path.size()) {
+        if (it->playable_) {
+            it->playable_ = false;
+            it->dirty_ = true;
+            delta = -1;
+            if (updateCounts)
+                it->shiftChildrenCounts(delta);
+        }
+    }
+    else
+        delta = it->removeItem(path, end + 1, updateCounts);
 
-    if (! residue.empty())
-        range.first->insertItem(std::move(residue));
+    if (delta == 0)
+        return 0;
+    if (updateCounts) {
+        for (auto sibling = it; sibling != children_.end(); ++sibling)
+            sibling->accumulatedItemCount_ += delta;
+    }
+    // Such node has no Items, so removing it does not affect counts.
+    if (! it->playable_ && it->children_.empty()) {
+        children_.erase(it);
+        clearChildIndex();
+    }
+    return delta;
+}
+
+void Node::shiftChildrenCounts(const int delta)
+{
+    for (Node & child : children_)
+        child.accumulatedItemCount_ += delta;
 }
 
-void Node::recalculateItemCount(int precedingCount)
+void Node::recalculateItemCount(int precedingCount,
+                                const std::size_t classCount,
+                                const ItemClassifier & classifier)
 {
+    // Clean node, copied from another tree, may lack class counts or have
+    // counts of another ItemClassifier.
+    if (! dirty_ && classCount != 0 && ! hasClassCounts(classCount))
+        markAllDirty();
+    if (! dirty_) {
+        // Counts of descendants are up to date, so itemCount() is correct.
+        accumulatedItemCount_ = precedingCount + itemCount();
+        return;
+    }
     accumulatedItemCount_ = precedingCount;
     precedingCount = playable_ ? 1 : 0;
+
+    itemClass_ = noItemClass;
+    if (playable_ && classCount != 0) {
+        const int itemClass = classifier(* this);
+        if (itemClass >= 0 && std::size_t(itemClass) < classCount)
+            itemClass_ = static_cast<std::uint8_t>(itemClass);
+    }
+
     for (Node & child : children_) {
-        child.recalculateItemCount(precedingCount);
+        child.recalculateItemCount(precedingCount, classCount, classifier);
         precedingCount = child.accumulatedItemCount_;
     }
     accumulatedItemCount_ += precedingCount;
+
+    if (childTables_ == nullptr || childTables_->index.empty())
+        buildChildIndex();
+    if (classCount == 0 || children_.empty()) {
+        if (childTables_ != nullptr)
+            childTables_->classCounts.clear();
+    }
+    else {
+        if (childTables_ == nullptr)
+            childTables_.reset(new ChildTables);
+        std::vector<int> & counts = childTables_->classCounts;
+        counts.resize(children_.size() * classCount);
+        for (std::size_t c = 0; c < classCount; ++c) {
+            counts[c] = (itemClass_ == c ? 1 : 0) +
+                        children_.front().classItemCount(c);
+        }
+        for (std::size_t i = 1; i < children_.size(); ++i) {
+            for (std::size_t c = 0; c < classCount; ++c) {
+                counts[i * classCount + c] = counts[(i - 1) * classCount + c]
+                                             + children_[i].classItemCount(c);
+            }
+        }
+    }
+    if (childTables_ != nullptr)
+        releaseEmptyChildTables();
+    updateHash();
+    dirty_ = false;
+}
+
+bool Node::hasClassCounts(const std::size_t classCount) const
+{
+    if (children_.empty())
+        return itemClass_ == noItemClass || itemClass_ < classCount;
+    return childTables_ != nullptr &&
+           childTables_->classCounts.size() == children_.size() * classCount;
+}
+
+int Node::classItemCount(const std::size_t itemClass) const
+{
+    assert(! dirty_);
+    if (children_.empty())
+        return itemClass_ == itemClass ? 1 : 0;
+    const std::vector<int> & counts = childTables_->classCounts;
+    return counts[counts.size() - counts.size() / children_.size()
+                  + itemClass];
+}
+
+int Node::classItemId(const std::size_t itemClass, int index) const
+{
+    const Node * node = this;
+    int itemId = 0;
+    while (index != 0 || node->itemClass_ != itemClass) {
+        const std::size_t childCount = node->children_.size();
+        if (childCount == 0)
+            throw Error("no such child.");
+        const std::vector<int> & counts = node->childTables_->classCounts;
+        const std::size_t classCount = counts.size() / childCount;
+        // Find a child that contains (or is itself) the necessary Item.
+        std::size_t low = 0, high = childCount;
+        while (low < high) {
+            const std::size_t middle = low + (high - low) / 2;
+            if (counts[middle * classCount + itemClass] <= index)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        if (low == childCount)
+            throw Error("no such child.");
+        if (low == 0) {
+            if (node->itemClass_ == itemClass)
+                --index;
+            if (node->playable_)
+                ++itemId;
+        }
+        else {
+            index -= counts[(low - 1) * classCount + itemClass];
+            itemId += node->children_[low - 1].accumulatedItemCount_;
+        }
+        node = & node->children_[low];
+    }
+    return itemId;
+}
+
+void Node::resolveItemPaths(const std::pair<int, std::size_t> * begin,
+                            const std::pair<int, std::size_t> * const end,
+                            const int offset, std::string & path,
+                            std::vector<std::string> & result) const
+{
+    if (playable_) {
+        // This node's Item is the first one, relative id 0.
+        for (; begin != end && begin->first == offset; ++begin)
+            result[begin->second] = path;
+    }
+    auto child = children_.cbegin();
+    while (begin != end) {
+        // Find a child that contains the necessary Item.
+        child = std::upper_bound(child, children_.cend(), begin->first - offset,
+        [](const int id, const Node & node) {
+            return id < node.accumulatedItemCount_;
+        });
+        if (child == children_.cend())
+            throw Error("no such child.");
+        const int childOffset = offset +
+                                (child == children_.cbegin() ?
+                                 (playable_ ? 1 : 0) :
+                                 (child - 1)->accumulatedItemCount_);
+        const int childEnd = offset + child->accumulatedItemCount_;
+        const auto * const groupEnd = std::lower_bound(
+                                          begin, end, std::make_pair(
+                                              childEnd, std::size_t(0)));
+
+        const std::size_t pathSize = path.size();
+        if (! path.empty())
+            path += '/';
+        path += child->name();
+        child->resolveItemPaths(begin, groupEnd, childOffset, path, result);
+        path.resize(pathSize);
+        begin = groupEnd;
+    }
+}
+
+std::size_t Node::itemPathsSize(const std::size_t pathSize) const
+{
+    std::size_t result = playable_ ? pathSize : 0;
+    for (const Node & child : children_) {
+        // Root has empty name, its children's paths start without '/'.
+        const std::size_t separatorSize = (pathSize == 0 ? 0 : 1);
+        result += child.itemPathsSize(pathSize + separatorSize +
+                                      child.name().size());
+    }
+    return result;
+}
+
+void Node::diff(const Node & newNode, std::string & path,
+                const ItemPathVisitor & added,
+                const ItemPathVisitor & removed) const
+{
+    if (! dirty_ && ! newNode.dirty_ && hash_ == newNode.hash_)
+        return;
+    if (playable_ && ! newNode.playable_)
+        removed(path);
+    else if (! playable_ && newNode.playable_)
+        added(path);
+
+    const std::size_t size = path.size();
+    const auto appendName = [&path, size](const Node & child) {
+        // Root has empty name, its children's paths start without '/'.
+        if (size != 0)
+            path += '/';
+        path += child.name();
+    };
+    const auto visitAdded = [&added](int, const std::string & itemPath) {
+        added(itemPath);
+    };
+    const auto visitRemoved = [&removed](int, const std::string & itemPath) {
+        removed(itemPath);
+    };
+
+    auto oldIt = children_.cbegin();
+    auto newIt = newNode.children_.cbegin();
+    while (oldIt != children_.cend() || newIt != newNode.children_.cend()) {
+        const int order =
+            oldIt == children_.cend() ? 1 :
+            newIt == newNode.children_.cend() ? -1 :
+            oldIt->nameId_ == newIt->nameId_ ? 0 :
+            oldIt->name().compare(newIt->name());
+        if (order == 0) {
+            appendName(* oldIt);
+            oldIt->diff(* newIt, path, added, removed);
+            ++oldIt;
+            ++newIt;
+        }
+        else if (order < 0) {
+            appendName(* oldIt);
+            (oldIt++)->visitItems(path, 0, visitRemoved);
+        }
+        else {
+            appendName(* newIt);
+            (newIt++)->visitItems(path, 0, visitAdded);
+        }
+        path.resize(size);
+    }
+}
+
+void Node::merge(const Node & other)
+{
+    if (! dirty_ && ! other.dirty_ && hash_ == other.hash_)
+        return;
+    dirty_ = true;
+    if (other.playable_)
+        playable_ = true;
+    if (other.children_.empty())
+        return;
+
+    std::vector<Node> merged;
+    merged.reserve(std::max(children_.size(), other.children_.size()));
+    auto it = children_.begin();
+    auto otherIt = other.children_.cbegin();
+    while (it != children_.end() || otherIt != other.children_.cend()) {
+        const int order =
+            it == children_.end() ? 1 :
+            otherIt == other.children_.cend() ? -1 :
+            it->nameId_ == otherIt->nameId_ ? 0 :
+            it->name().compare(otherIt->name());
+        if (order == 0) {
+            it->merge(* otherIt++);
+            merged.emplace_back(std::move(* it++));
+        }
+        else if (order < 0)
+            merged.emplace_back(std::move(* it++));
+        else
+            merged.emplace_back(* otherIt++);
+    }
+    children_.swap(merged);
+    clearChildIndex();
+}
+
+void Node::updateHash()
+{
+    hash_ = mix((std::uint64_t(nameId_) << 1) | (playable_ ? 1 : 0));
+    for (const Node & child : children_)
+        hash_ = mix(hash_ ^ child.hash_) + 1;
+}
+
+void Node::markAllDirty()
+{
+    dirty_ = true;
+    // Children could have been modified without updating the index.
+    clearChildIndex();
+    for (Node & child : children_)
+        child.markAllDirty();
 }
 
 void Node::cleanUp()
+{
+    cleanUpChildren();
+    std::for_each(children_.begin(), children_.end(),
+                  std::bind(& Node::cleanUp, std::placeholders::_1));
+    updateHash();
+}
+
+void Node::cleanUpChildren()
 {
     int prev = playable_ ? 1 : 0;
     for (Node & child : children_) {
@@ -188,38 +863,144 @@ void Node::cleanUp()
             prev = cur;
     }
 
-    children_.erase(std::remove_if(children_.begin(), children_.end(),
-    [](const Node & node) {
-        return node.accumulatedItemCount_ == 0;
-    }),
-                    children_.end());
-
-    std::for_each(children_.begin(), children().end(),
-                  std::bind(& Node::cleanUp, std::placeholders::_1));
+    // Row of class counts of a removed child repeats the preceding row, so
+    // rows are removed together with children.
+    std::vector<int> * const counts =
+        childTables_ == nullptr ? nullptr : & childTables_->classCounts;
+    const std::size_t classCount =
+        counts == nullptr || children_.empty() ?
+        0 : counts->size() / children_.size();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < children_.size(); ++i) {
+        if (children_[i].accumulatedItemCount_ == 0)
+            continue;
+        if (kept != i) {
+            children_[kept] = std::move(children_[i]);
+            std::copy_n(counts->begin() + std::ptrdiff_t(i * classCount),
+                        classCount,
+                        counts->begin() + std::ptrdiff_t(kept * classCount));
+        }
+        ++kept;
+    }
+    if (kept != children_.size()) {
+        children_.erase(children_.begin() + std::ptrdiff_t(kept),
+                        children_.end());
+        if (classCount != 0)
+            counts->resize(kept * classCount);
+        buildChildIndex();
+    }
 }
 
 void Node::validate() const
+{
+    validateChildren();
+    std::for_each(children_.cbegin(), children_.cend(),
+                  std::bind(& Node::validate, std::placeholders::_1));
+}
+
+void Node::validateChildren() const
 {
     if (children_.empty())
         return;
     if (! std::is_sorted(children_.cbegin(), children_.cend(),
                          CompareNodesByName())) {
-        throw Error(invalidStateMessage(name_) + " Children are not sorted "
+        throw Error(invalidStateMessage(name()) + " Children are not sorted "
                     "properly.");
     }
     {
         auto it = std::adjacent_find(children_.cbegin(), children_.cend(),
                                      EqualNodeNames());
         if (it != children_.cend()) {
-            throw Error(invalidStateMessage(name_) +
-                        " Duplicate children with name \"" + it->name_ + "\".");
+            throw Error(invalidStateMessage(name()) +
+                        " Duplicate children with name \"" + it->name() +
+                        "\".");
         }
     }
-    if (children_.front().name_.empty())
-        throw Error(invalidStateMessage(name_) + " Child with empty name.");
+    if (children_.front().name().empty())
+        throw Error(invalidStateMessage(name()) + " Child with empty name.");
+}
 
-    std::for_each(children_.cbegin(), children().cend(),
-                  std::bind(& Node::validate, std::placeholders::_1));
+void Node::appendBinary(std::string & buffer) const
+{
+    appendBinaryRecord(buffer);
+    for (const Node & child : children_)
+        child.appendBinary(buffer);
+}
+
+void Node::appendBinaryRecord(std::string & buffer) const
+{
+    buffer += static_cast<char>(playable_ ? 1 : 0);
+    const std::string & nodeName = name();
+    Binary::appendUint32(buffer, static_cast<std::uint32_t>(nodeName.size()));
+    buffer += nodeName;
+    Binary::appendUint32(buffer, static_cast<std::uint32_t>(children_.size()));
+    Binary::appendUint32(buffer,
+                         static_cast<std::uint32_t>(accumulatedItemCount_));
+}
+
+void Node::readBinary(const char * & pos, const char * const end)
+{
+    const int childCount = Binary::readInt(pos, end);
+    accumulatedItemCount_ = Binary::readInt(pos, end);
+    // Every child occupies at least 13 bytes, so childCount is checked before
+    // reserving to avoid huge allocations in case of corrupted file.
+    if (childCount > (end - pos) / 13)
+        throw Error(wrongFileFormatMessage() + " Unexpected end of file.");
+    children_.reserve(static_cast<std::size_t>(childCount));
+
+    int precedingCount = playable_ ? 1 : 0;
+    for (int i = 0; i < childCount; ++i) {
+        if (pos == end)
+            throw Error(wrongFileFormatMessage() + " Unexpected end of file.");
+        const bool playable = (* pos++ != 0);
+        const std::uint32_t nameSize = Binary::readUint32(pos, end);
+        if (std::uint32_t(end - pos) < nameSize)
+            throw Error(wrongFileFormatMessage() + " Unexpected end of file.");
+        children_.emplace_back(Node(pos, nameSize, playable));
+        pos += nameSize;
+
+        Node & child = children_.back();
+        child.readBinary(pos, end);
+        // Precomputed counts are verified as they are read, so nodesChanged()
+        // is not needed to make a consistent tree.
+        if (child.accumulatedItemCount_ != precedingCount + child.itemCount()) {
+            throw Error(wrongFileFormatMessage() +
+                        " Wrong Item count in node \"" + child.name() + "\".");
+        }
+        precedingCount = child.accumulatedItemCount_;
+    }
+    updateHash();
+    buildChildIndex();
+    dirty_ = false;
+}
+
+void Node::readMappable(const MappableLayout & layout,
+                        const std::uint32_t index)
+{
+    accumulatedItemCount_ = layout.accumulatedItemCount(index);
+    if (accumulatedItemCount_ < 0)
+        throw Error(wrongFileFormatMessage() + " Too large number.");
+    layout.checkChildren(index);
+    const std::uint32_t first = layout.firstChild(index);
+    const std::uint32_t last = first + layout.childCount(index);
+    children_.reserve(layout.childCount(index));
+
+    int precedingCount = playable_ ? 1 : 0;
+    for (std::uint32_t i = first; i < last; ++i) {
+        layout.checkName(i);
+        children_.emplace_back(Node(layout.name(i), layout.nameSize(i),
+                                    layout.isPlayable(i)));
+        Node & child = children_.back();
+        child.readMappable(layout, i);
+        if (child.accumulatedItemCount_ != precedingCount + child.itemCount()) {
+            throw Error(wrongFileFormatMessage() +
+                        " Wrong Item count in node \"" + child.name() + "\".");
+        }
+        precedingCount = child.accumulatedItemCount_;
+    }
+    updateHash();
+    buildChildIndex();
+    dirty_ = false;
 }
 
 
@@ -229,88 +1010,695 @@ Tree::Tree()
     root_.accumulatedItemCount_ = 0;
 }
 
-std::string Tree::load(const std::string & filename)
+void Tree::clear()
 {
     root_.children_.clear();
+    root_.childTables_.reset();
+    root_.dirty_ = true;
+    nodesChanged();
+}
+
+void Tree::clearInBackground()
+{
+    std::unique_ptr<std::vector<Node>> nodes(new std::vector<Node>());
+    nodes->swap(root_.children_);
+    clear();
+    // If the reclaimer fails, nodes are destroyed in this thread.
+    NodeReclaimer::instance().reclaim(nodes);
+}
+
+std::string Tree::load(const std::string & filename)
+{
+    std::string error = loadFile(filename);
+    if (! error.empty())
+        return error;
+    bool changed = false;
+    error = replayJournal(Journal::filename(filename), changed);
+    if (! error.empty())
+        return error;
+    // Nodes loaded in binary formats are clean, but have no class counts.
+    if (classCount_ != 0)
+        allNodesChanged();
+    else if (changed) {
+        // Replayed changes are not counted.
+        nodesChanged();
+    }
+    return error;
+}
+
+std::string Tree::loadFile(const std::string & filename)
+{
+    // Destroying small tree is faster than starting a thread.
+    constexpr int minBackgroundClearItemCount = 1 << 14;
+    if (itemCount() >= minBackgroundClearItemCount)
+        clearInBackground();
+    else
+        clear();
+    root_.dirty_ = true;
+
+    std::string data;
+    if (! readFile(filename, data))
+        return readingFailedMessage(filename);
+
+    const bool isBinary = data.size() >= Binary::magicSize &&
+                          std::equal(Binary::magic,
+                                     Binary::magic + Binary::magicSize,
+                                     data.data());
+    if (isBinary || MappableLayout::hasMagic(data.data(), data.size())) {
+        if (data.size() < Binary::headerSize)
+            return wrongFileFormatMessage() + " Unexpected end of file.";
+        if (isBinary) {
+            return loadBinary(data.data() + Binary::magicSize,
+                              data.data() + data.size());
+        }
+        return loadMappable(data.data(), data.size());
+    }
+    return loadText(data.data(), data.data() + data.size());
+}
+
+std::string Tree::replayJournal(const std::string & filename,
+                                bool & changed)
+{
+    changed = false;
+    if (! std::ifstream(filename))
+        return std::string();
+    std::string data;
+    if (! readFile(filename, data))
+        return readingFailedMessage(filename);
+
+    std::string path;
+    for (std::size_t begin = 0; begin < data.size(); ) {
+        const std::size_t end = data.find('\n', begin);
+        // Incomplete last record is a result of interrupted writing.
+        if (end == std::string::npos)
+            break;
+        const char symbol = data[begin];
+        path.assign(data, begin + 1, end - begin - 1);
+        if (path.empty() || (symbol != Journal::insertSymbol &&
+                             symbol != Journal::removeSymbol)) {
+            return "journal \"" + filename + "\" is corrupted.";
+        }
+        try {
+            // Counts are recalculated by nodesChanged() after replaying.
+            if (symbol == Journal::insertSymbol)
+                root_.insertItem(path, 0, false);
+            else
+                root_.removeItem(path, 0, false);
+        }
+        catch (const Error & e) {
+            return e.what();
+        }
+        changed = true;
+        begin = end + 1;
+    }
+    return std::string();
+}
 
-    std::ifstream is(filename);
+const Node * Tree::findNode(const char * const path, const std::size_t size,
+                            int & firstItemId) const
+{
+    const Node * node = & root_;
+    firstItemId = 0;
+    // Path is split into names exactly as in Node::insertItem().
+    for (std::size_t begin = 0; begin < size; ) {
+        std::size_t end = size;
+        if (begin + 1 < size) {
+            const void * const separator =
+                std::memchr(path + begin + 1, '/', size - begin - 1);
+            if (separator != nullptr)
+                end = std::size_t(static_cast<const char *>(separator) - path);
+        }
+        if (end + 1 == size)
+            return nullptr;
+        const auto it = node->findChild(path + begin, end - begin);
+        if (it == node->children_.cend())
+            return nullptr;
+        firstItemId += (it == node->children_.cbegin()) ?
+                       (node->playable_ ? 1 : 0)
+                       : (it - 1)->accumulatedItemCount_;
+        node = & * it;
+        begin = end + 1;
+    }
+    return node;
+}
+
+std::string Tree::loadText(const char * pos, const char * const end)
+{
     /// Holds pointers to last node on each currently open level.
     std::vector<Node *> nodeStack { & root_ };
+    // Each line is a node, adding its name to the pool must not trigger
+    // rebuilding of the pool's lookup table.
+    NamePool & namePool = NamePool::instance();
+    namePool.reserve(std::size_t(std::count(pos, end, '\n')) + 1);
+
+    // Parsed lines are collected and their names are interned in batches,
+    // which is several times faster than interning names one at a time.
+    struct Line {
+        std::size_t indent;
+        bool playable;
+    };
+    constexpr std::size_t batchSize = 4096;
+    std::vector<Line> lines;
+    std::vector<NamePool::Name> names;
+    std::vector<NamePool::Id> nameIds(batchSize);
+    lines.reserve(batchSize);
+    names.reserve(batchSize);
+    const auto addNodes = [&] {
+        namePool.intern(names.data(), names.size(), nameIds.data());
+        for (std::size_t i = 0; i < lines.size(); ++i) {
+            // Node's level is determined by indent.
+            nodeStack.resize(lines[i].indent + 1);
+            nodeStack.back()->children_.emplace_back(
+                Node(nameIds[i], lines[i].playable));
+            nodeStack.emplace_back(& nodeStack.back()->children_.back());
+        }
+        lines.clear();
+        names.clear();
+    };
+    /// nodeStack.size() after adding all nodes from lines.
+    std::size_t levelCount = 1;
 
-    std::string line;
-    while (std::getline(is, line)) {
-        const std::size_t indent = line.find_first_not_of(indentSymbol);
-        if (indent == std::string::npos ||
-                (line[indent] != unplayableSymbol &&
-                 line[indent] != itemSymbol)) {
+    while (pos != end) {
+        const char * lineEnd = static_cast<const char *>(
+                                   std::memchr(pos, '\n',
+                                               std::size_t(end - pos)));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        const char * const nextLine = (lineEnd == end ? end : lineEnd + 1);
+# ifdef _WIN32
+        // Line endings were converted by std::getline() in text mode before.
+        if (lineEnd != pos && lineEnd[-1] == '\r')
+            --lineEnd;
+# endif
+
+        const char * name = pos;
+        while (name != lineEnd && * name == indentSymbol)
+            ++name;
+        if (name == lineEnd ||
+                (* name != unplayableSymbol && * name != itemSymbol)) {
             // Invalid line detected -> end of parsing.
             break;
         }
-        if (indent == line.size() - 1)
+        const std::size_t indent = std::size_t(name - pos);
+        const bool playable = (* name++ == itemSymbol);
+        if (name == lineEnd)
             return wrongFileFormatMessage() + " Empty name.";
-        if (indent > nodeStack.size() - 1)
+        if (indent > levelCount - 1)
             return wrongFileFormatMessage() + " Unexpectedly large indent.";
 
-        // Node's level is determined by indent.
-        nodeStack.erase(
-            nodeStack.begin() + 1 + static_cast<std::ptrdiff_t>(indent),
-            nodeStack.end());
-
-        const bool playable = (line[indent] == itemSymbol);
-        std::string name = std::move(line).substr(indent + 1);
-        nodeStack.back()->children_.emplace_back(
-            Node(std::move(name), playable));
+        levelCount = indent + 2;
+        lines.push_back(Line { indent, playable });
+        names.push_back(NamePool::Name { name, std::size_t(lineEnd - name) });
+        if (lines.size() == batchSize)
+            addNodes();
+        pos = nextLine;
+    }
+    addNodes();
 
-        nodeStack.emplace_back(& nodeStack.back()->children_.back());
+    try {
+        validate();
     }
+    catch (const Error & e) {
+        return e.what();
+    }
+    return std::string();
+}
 
-    if (CommonUtilities::isStreamFine(is)) {
-        try {
-            validate();
+std::string Tree::loadBinary(const char * pos, const char * const end)
+{
+    try {
+        const std::uint32_t version = Binary::readUint32(pos, end);
+        if (version != Binary::version) {
+            return wrongFileFormatMessage() + " Unsupported binary version " +
+                   std::to_string(version) + '.';
         }
-        catch (const Error & e) {
-            return e.what();
+        // Root record: not playable, empty name.
+        if (end - pos < 5 || pos[0] != 0 || pos[1] != 0 || pos[2] != 0 ||
+                pos[3] != 0 || pos[4] != 0) {
+            return wrongFileFormatMessage() + " Invalid root node.";
         }
-        return std::string();
+        pos += 5;
+        root_.readBinary(pos, end);
+        if (pos != end)
+            return wrongFileFormatMessage() + " Unexpected data after tree.";
+        if (root_.accumulatedItemCount_ != root_.itemCount())
+            return wrongFileFormatMessage() + " Wrong total Item count.";
+        validate();
     }
-    return "reading file \"" + filename + "\" failed.";
+    catch (const Error & e) {
+        root_.children_.clear();
+        root_.accumulatedItemCount_ = 0;
+        return e.what();
+    }
+    return std::string();
 }
 
-bool Tree::save(const std::string & filename) const
+std::string Tree::loadMappable(const char * const data, const std::size_t size)
 {
-    std::ofstream os(filename);
-    for (const Node & topNode : root_.children())
-        print(os, topNode);
+    MappableLayout layout;
+    std::string error = layout.reset(data, size);
+    if (! error.empty())
+        return error;
+    try {
+        // Children of each node must immediately follow children of the
+        // previous node in breadth-first order. Otherwise several nodes could
+        // share children and the file would expand into exponentially many
+        // nodes.
+        std::uint32_t nextChild = 1;
+        for (std::uint32_t node = 0; node < layout.nodeCount(); ++node) {
+            layout.checkChildren(node);
+            const std::uint32_t childCount = layout.childCount(node);
+            if (childCount != 0 && layout.firstChild(node) != nextChild) {
+                throw Error(wrongFileFormatMessage() +
+                            " Misplaced children of node " +
+                            std::to_string(node) + '.');
+            }
+            nextChild += childCount;
+        }
+        if (nextChild != layout.nodeCount())
+            throw Error(wrongFileFormatMessage() + " Unreachable nodes.");
+        root_.readMappable(layout, 0);
+        if (root_.accumulatedItemCount_ != root_.itemCount())
+            return wrongFileFormatMessage() + " Wrong total Item count.";
+        validate();
+    }
+    catch (const Error & e) {
+        error = e.what();
+    }
+    if (! error.empty()) {
+        root_.children_.clear();
+        root_.accumulatedItemCount_ = 0;
+    }
+    return error;
+}
+
+bool Tree::save(const std::string & filename, const Format format) const
+{
+    if (format == Format::mappable)
+        return FlatTree(* this).save(filename);
+    const bool binary = (format == Format::binary);
+
+    // The tree is cut into records of large nodes and whole subtrees below
+    // them. Consecutive pieces are grouped into tasks of limited size. Tasks
+    // are serialized into buffers concurrently, buffers are written in
+    // pre-order as soon as they are ready. So only a few small buffers exist
+    // at a time instead of the whole file.
+    constexpr std::size_t maxTaskItemCount = minParallelWork;
+    const auto pieceItemCount = [](const Node & node) {
+        return std::max<std::size_t>(1, std::size_t(node.itemCount()));
+    };
+    struct Piece {
+        const Node * node;
+        std::size_t depth;
+        bool isSubtree;
+    };
+    std::vector<Piece> pieces;
+    std::vector<Piece> stack { { & root_, 0, false } };
+    while (! stack.empty()) {
+        Piece piece = stack.back();
+        stack.pop_back();
+        piece.isSubtree = pieceItemCount(* piece.node) <= maxTaskItemCount;
+        pieces.push_back(piece);
+        if (! piece.isSubtree) {
+            const std::vector<Node> & children = piece.node->children_;
+            for (auto it = children.rbegin(); it != children.rend(); ++it)
+                stack.push_back({ & * it, piece.depth + 1, false });
+        }
+    }
+
+    /// Task i consists of pieces in [taskBegins[i], taskBegins[i + 1]).
+    std::vector<std::size_t> taskBegins;
+    std::size_t taskItemCount = maxTaskItemCount;
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        const std::size_t count = pieces[i].isSubtree ?
+                                  pieceItemCount(* pieces[i].node) : 1;
+        if (taskItemCount + count > maxTaskItemCount) {
+            taskBegins.push_back(i);
+            taskItemCount = 0;
+        }
+        taskItemCount += count;
+    }
+    taskBegins.push_back(pieces.size());
+
+    const auto appendPiece = [&](const Piece & piece, std::string & buffer) {
+        if (binary) {
+            if (piece.isSubtree)
+                piece.node->appendBinary(buffer);
+            else
+                piece.node->appendBinaryRecord(buffer);
+        }
+        else if (piece.depth == 0) {
+            // Root is not written in text format.
+            if (piece.isSubtree) {
+                for (const Node & topNode : root_.children_)
+                    appendText(buffer, topNode, 0);
+            }
+        }
+        else if (piece.isSubtree)
+            appendText(buffer, * piece.node, piece.depth - 1);
+        else
+            appendTextLine(buffer, * piece.node, piece.depth - 1);
+    };
+
+    std::ofstream os;
+    if (binary) {
+        os.open(filename, std::ios::binary);
+        std::string header(Binary::magic, Binary::magicSize);
+        Binary::appendUint32(header, Binary::version);
+        os.write(header.data(), static_cast<std::streamsize>(header.size()));
+    }
+    else
+        os.open(filename);
+    Concurrency::orderedParallelFor<std::string>(
+        taskBegins.size() - 1,
+    [&](const std::size_t task, std::string & buffer) {
+        buffer.clear();
+        for (std::size_t i = taskBegins[task]; i < taskBegins[task + 1]; ++i)
+            appendPiece(pieces[i], buffer);
+    },
+    [&](std::size_t, const std::string & buffer) {
+        os.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    });
+    // Errors of writing buffered data are detected only when it is flushed.
+    os.close();
     return CommonUtilities::isStreamFine(os);
 }
 
 std::string Tree::getItemAbsolutePath(const int itemId) const
 {
-    std::string path = root_.getRelativeChildItemPath(itemId);
+    std::string path;
+    getItemAbsolutePath(itemId, path);
+    return path;
+}
+
+void Tree::getItemAbsolutePath(const int itemId, std::string & path) const
+{
+    path.clear();
+    root_.appendRelativeItemPath(itemId, path);
     assert(! path.empty() && path.back() == '/');
     // remove extra '/'.
     path.pop_back();
-    return path;
 }
 
-void Tree::insertItem(std::string absolutePath)
+std::vector<std::string> Tree::getItemAbsolutePaths(
+    const std::vector<int> & itemIds) const
+{
+    const int count = itemCount();
+    // Sorting {itemId, index} pairs lets each node be visited at most once.
+    std::vector<std::pair<int, std::size_t>> sorted;
+    sorted.reserve(itemIds.size());
+    for (std::size_t i = 0; i < itemIds.size(); ++i) {
+        if (itemIds[i] < 0 || itemIds[i] >= count)
+            throw Error("no such Item.");
+        sorted.emplace_back(itemIds[i], i);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<std::string> result(itemIds.size());
+    std::string path;
+    root_.resolveItemPaths(sorted.data(), sorted.data() + sorted.size(), 0,
+                           path, result);
+    return result;
+}
+
+PackedItems Tree::getAllItemsPacked() const
 {
-    root_.insertItem(std::move(absolutePath));
+    const std::vector<Node> & topNodes = root_.children_;
+    const std::size_t maxThreadCount =
+        std::size_t(itemCount()) < minParallelWork ?
+        1 : Concurrency::hardwareThreadCount();
+    std::vector<std::size_t> dataOffsets(topNodes.size() + 1, 0);
+    Concurrency::parallelFor(topNodes.size(), [&](const std::size_t i) {
+        const Node & node = topNodes[i];
+        dataOffsets[i + 1] = node.itemPathsSize(node.name().size());
+    }, maxThreadCount);
+    for (std::size_t i = 1; i < dataOffsets.size(); ++i)
+        dataOffsets[i] += dataOffsets[i - 1];
+
+    PackedItems result;
+    result.data.resize(dataOffsets.back());
+    result.offsets.resize(std::size_t(itemCount()) + 1);
+    result.offsets.back() = result.data.size();
+    char * const data = & result.data[0];
+    std::size_t * const offsets = result.offsets.data();
+
+    // Each top-level subtree is written to its own ranges of data and offsets.
+    Concurrency::parallelFor(topNodes.size(), [&](const std::size_t i) {
+        const std::size_t firstId =
+            i == 0 ? 0 : std::size_t(topNodes[i - 1].accumulatedItemCount_);
+        std::size_t position = dataOffsets[i];
+        topNodes[i].forEachItem(
+        [&](const int itemId, const std::string & path) {
+            offsets[firstId + std::size_t(itemId)] = position;
+            std::copy(path.begin(), path.end(), data + position);
+            position += path.size();
+        });
+    }, maxThreadCount);
+    return result;
+}
+
+std::pair<int, int> Tree::itemIdRange(const std::string & absolutePath) const
+{
+    int first;
+    const Node * const node = findNode(absolutePath.data(),
+                                       absolutePath.size(), first);
+    if (node == nullptr)
+        throw Error("no such node.");
+    return { first, first + node->itemCount() };
+}
+
+int Tree::itemId(const char * const absolutePath, const std::size_t size) const
+{
+    int first;
+    const Node * const node = findNode(absolutePath, size, first);
+    return node == nullptr || ! node->playable_ ? -1 : first;
+}
+
+void Tree::insertItem(const std::string & absolutePath)
+{
+    const int delta = root_.insertItem(absolutePath, 0, incrementalCounting_);
+    if (incrementalCounting_)
+        root_.accumulatedItemCount_ += delta;
+}
+
+bool Tree::removeItem(const std::string & absolutePath)
+{
+    const int delta = root_.removeItem(absolutePath, 0, incrementalCounting_);
+    if (incrementalCounting_)
+        root_.accumulatedItemCount_ += delta;
+    return delta != 0;
+}
+
+void Tree::setIncrementalCounting(const bool enabled)
+{
+    if (enabled && ! incrementalCounting_)
+        nodesChanged();
+    incrementalCounting_ = enabled;
+}
+
+void Tree::diff(const Tree & newTree, const ItemPathVisitor & added,
+                const ItemPathVisitor & removed) const
+{
+    std::string path;
+    root_.diff(newTree.root_, path, added, removed);
+}
+
+void Tree::merge(const Tree & other)
+{
+    root_.merge(other.root_);
+    if (classCount_ == 0)
+        nodesChanged();
+    else {
+        // Copied subtrees have class counts of other's classifier.
+        allNodesChanged();
+    }
+}
+
+void Tree::setItemClassifier(ItemClassifier classifier, const int classCount)
+{
+    if (classCount < 0 || classCount >= Node::noItemClass)
+        throw Error("unsupported number of Item classes.");
+    if (! classifier || classCount == 0) {
+        classifier_ = nullptr;
+        classCount_ = 0;
+    }
+    else {
+        classifier_ = std::move(classifier);
+        classCount_ = classCount;
+    }
+    allNodesChanged();
+}
+
+int Tree::itemCount(const int itemClass) const
+{
+    if (itemClass < 0 || itemClass >= classCount_)
+        throw Error("no such Item class.");
+    // Class counts are not updated incrementally.
+    if (root_.dirty_)
+        throw Error("Item class counts are out of date.");
+    return root_.classItemCount(std::size_t(itemClass));
+}
+
+int Tree::classItemId(const int itemClass, const int index) const
+{
+    if (index < 0 || index >= itemCount(itemClass))
+        throw Error("no such Item.");
+    return root_.classItemId(std::size_t(itemClass), index);
 }
 
 void Tree::nodesChanged()
 {
-    root_.recalculateItemCount(0);
+    const std::size_t classCount = std::size_t(classCount_);
+    const auto needsRecalculation = [](const Node & node) {
+        return node.dirty_;
+    };
+    std::vector<Node *> splitNodes;
+    const std::vector<Node *> subtrees = splitIntoSubtrees(
+        root_, needsRecalculation, [](Node &) {}, splitNodes);
+    if (subtrees.size() > 1) {
+        // Counts inside each subtree do not depend on preceding nodes.
+        Concurrency::parallelFor(subtrees.size(), [&](const std::size_t i) {
+            subtrees[i]->recalculateItemCount(0, classCount, classifier_);
+        });
+    }
+    // Subtrees are clean now, so only split nodes are recalculated here and
+    // accumulated counts of subtrees are stitched together.
+    root_.recalculateItemCount(0, classCount, classifier_);
+}
+
+void Tree::allNodesChanged()
+{
+    root_.markAllDirty();
+    nodesChanged();
 }
 
 void Tree::cleanUp()
 {
-    root_.cleanUp();
+    std::vector<Node *> splitNodes;
+    const std::vector<Node *> subtrees = splitIntoSubtrees(
+        root_, [](const Node &) { return true; },
+        std::mem_fn(& Node::cleanUpChildren), splitNodes);
+    Concurrency::parallelFor(subtrees.size(), [&](const std::size_t i) {
+        subtrees[i]->cleanUp();
+    });
+    // Children of split nodes have been cleaned up, update hashes bottom-up.
+    std::for_each(splitNodes.rbegin(), splitNodes.rend(),
+                  std::mem_fn(& Node::updateHash));
 }
 
 void Tree::validate() const
 {
-    root_.validate();
+    std::vector<const Node *> splitNodes;
+    const std::vector<const Node *> subtrees = splitIntoSubtrees(
+        root_, [](const Node &) { return true; },
+        std::mem_fn(& Node::validateChildren), splitNodes);
+    Concurrency::parallelFor(subtrees.size(), [&](const std::size_t i) {
+        subtrees[i]->validate();
+    });
+}
+
+template <class NodeType, class IsTask, class Split>
+std::vector<NodeType *> Tree::splitIntoSubtrees(
+    NodeType & root, const IsTask & isTask, const Split & split,
+    std::vector<NodeType *> & splitNodes)
+{
+    std::vector<NodeType *> subtrees;
+    if (! isTask(root))
+        return subtrees;
+    subtrees.push_back(& root);
+    const std::size_t threadCount = Concurrency::hardwareThreadCount();
+    // The check stops after visiting minParallelWork nodes, so it is cheap
+    // compared to processing of a large tree.
+    std::size_t budget = minParallelWork;
+    if (threadCount == 1 || ! exhaustsBudget(root, isTask, budget))
+        return subtrees;
+    // Several subtrees per thread balance subtrees of different size.
+    const std::size_t enoughSubtrees = 4 * threadCount;
+
+    std::vector<NodeType *> next;
+    while (subtrees.size() < enoughSubtrees) {
+        bool splitAny = false;
+        next.clear();
+        for (NodeType * const node : subtrees) {
+            if (node->children_.empty()) {
+                next.push_back(node);
+                continue;
+            }
+            splitAny = true;
+            split(* node);
+            splitNodes.push_back(node);
+            for (auto & child : node->children_) {
+                if (isTask(child))
+                    next.push_back(& child);
+            }
+        }
+        if (! splitAny)
+            break;
+        subtrees.swap(next);
+    }
+    return subtrees;
+}
+
+
+
+constexpr char Journal::insertSymbol, Journal::removeSymbol;
+constexpr std::size_t Journal::defaultCheckpointSize;
+
+Journal::Journal(std::string treeFilename)
+    : treeFilename_(std::move(treeFilename))
+{
+    std::ifstream is(filename(treeFilename_), std::ios::binary);
+    if (is.seekg(0, std::ios::end)) {
+        const std::streamoff fileSize = is.tellg();
+        if (fileSize > 0)
+            size_ = static_cast<std::size_t>(fileSize);
+    }
+}
+
+bool Journal::checkpoint(const Tree & tree, const Tree::Format format)
+{
+    // If saving is interrupted, the tree file must stay intact, otherwise both
+    // the tree and the journal would be lost. So the tree is saved to a
+    // temporary file, which then replaces the tree file.
+    const std::string temporaryFilename = treeFilename_ + ".tmp";
+    if (! tree.save(temporaryFilename, format)) {
+        std::remove(temporaryFilename.c_str());
+        return false;
+    }
+# ifdef _WIN32
+    // std::rename() does not replace existing files on Windows.
+    std::remove(treeFilename_.c_str());
+# endif
+    if (std::rename(temporaryFilename.c_str(), treeFilename_.c_str()) != 0) {
+        std::remove(temporaryFilename.c_str());
+        return false;
+    }
+    // The saved tree supersedes the journal. Removal fails if there is no
+    // journal, which is fine.
+    std::remove(filename(treeFilename_).c_str());
+    size_ = 0;
+    return true;
+}
+
+bool Journal::append(const char symbol, const std::string & absolutePath)
+{
+    if (absolutePath.find('\n') != std::string::npos)
+        throw Error("journaled path contains line break.");
+    std::string record;
+    record.reserve(absolutePath.size() + 2);
+    record += symbol;
+    record += absolutePath;
+    record += '\n';
+    // The file is opened for each record, so checkpoint() can remove it.
+    // Only the record is written, earlier records are not touched.
+    std::ofstream os(filename(treeFilename_),
+                     std::ios::binary | std::ios::app);
+    os.write(record.data(), static_cast<std::streamsize>(record.size()));
+    os.close();
+    if (! CommonUtilities::isStreamFine(os))
+        return false;
+    size_ += record.size();
+    return true;
 }
 
 
@@ -326,16 +1714,253 @@ RandomItemChooser::RandomItemChooser(const Seed seed) : engine_(seed)
 {
 }
 
-int RandomItemChooser::randomItemId(const Tree & tree)
+std::vector<std::string> RandomItemChooser::randomPaths(
+    const Tree & tree, const std::size_t count)
+{
+    return tree.getItemAbsolutePaths(randomItemIds(tree, count));
+}
+
+void RandomItemChooser::setExclusionSize(const std::size_t size)
+{
+    exclusionSize_ = size;
+    while (recentItemIds_.size() > exclusionSize_) {
+        excluded_[std::size_t(recentItemIds_.front())] = false;
+        recentItemIds_.pop_front();
+    }
+}
+
+void RandomItemChooser::clearExclusions()
+{
+    recentItemIds_.clear();
+    excluded_.clear();
+}
+
+int RandomItemChooser::randomItemId(const std::pair<int, int> itemIdRange)
+{
+    if (itemIdRange.first >= itemIdRange.second)
+        throw Error("can not choose random Item from empty range.");
+    return Distribution(itemIdRange.first,
+                        itemIdRange.second - 1)(engine_);
+}
+
+int RandomItemChooser::randomItemId(const Tree & tree, const int itemClass)
+{
+    const int count = tree.itemCount(itemClass);
+    if (count == 0)
+        throw Error("can not choose random Item from empty class.");
+    return tree.classItemId(itemClass, Distribution(0, count - 1)(engine_));
+}
+
+int RandomItemChooser::randomItemId(const int itemCount)
 {
-    if (tree.itemCount() == 0)
+    if (itemCount == 0)
         throw Error("can not choose random Item from tree without Items.");
-    const int maxId = tree.itemCount() - 1;
+    const int maxId = itemCount - 1;
     // If tree was changed since the last call to this method, update cached
     // distribution_.
     if (distribution_.b() != maxId)
         distribution_ = Distribution(0, maxId);
-    return distribution_(engine_);
+    if (exclusionSize_ == 0)
+        return distribution_(engine_);
+
+    if (excluded_.size() != std::size_t(itemCount)) {
+        clearExclusions();
+        excluded_.resize(std::size_t(itemCount), false);
+    }
+    const std::size_t capacity =
+        std::min(exclusionSize_, std::size_t(itemCount) / 2);
+    while (recentItemIds_.size() > capacity) {
+        excluded_[std::size_t(recentItemIds_.front())] = false;
+        recentItemIds_.pop_front();
+    }
+
+    int itemId;
+    do
+        itemId = distribution_(engine_);
+    while (excluded_[std::size_t(itemId)]);
+
+    if (capacity != 0) {
+        if (recentItemIds_.size() == capacity) {
+            excluded_[std::size_t(recentItemIds_.front())] = false;
+            recentItemIds_.pop_front();
+        }
+        recentItemIds_.push_back(itemId);
+        excluded_[std::size_t(itemId)] = true;
+    }
+    return itemId;
+}
+
+WeightedItemChooser::WeightedItemChooser()
+    : WeightedItemChooser(
+        static_cast<Seed>(
+            std::chrono::system_clock::now().time_since_epoch().count()))
+{
+}
+
+WeightedItemChooser::WeightedItemChooser(const Seed seed) : engine_(seed)
+{
+}
+
+void WeightedItemChooser::assign(const int itemCount, const double weight)
+{
+    if (itemCount < 0)
+        throw Error("negative Item count.");
+    assign(std::vector<double>(std::size_t(itemCount), weight));
+}
+
+void WeightedItemChooser::assign(std::vector<double> weights)
+{
+    for (const double weight : weights) {
+        if (! (weight >= 0) || ! std::isfinite(weight))
+            throw Error("weight must be finite and non-negative.");
+    }
+    weights_ = std::move(weights);
+    buildSums();
+}
+
+double WeightedItemChooser::weight(const int itemId) const
+{
+    if (itemId < 0 || itemId >= itemCount())
+        throw Error("no such Item.");
+    return weights_[std::size_t(itemId)];
+}
+
+void WeightedItemChooser::setWeight(const int itemId, const double weight)
+{
+    if (itemId < 0 || itemId >= itemCount())
+        throw Error("no such Item.");
+    if (! (weight >= 0) || ! std::isfinite(weight))
+        throw Error("weight must be finite and non-negative.");
+    const double delta = weight - weights_[std::size_t(itemId)];
+    weights_[std::size_t(itemId)] = weight;
+    for (std::size_t i = std::size_t(itemId) + 1; i < sums_.size();
+            i += i & (~i + 1)) {
+        sums_[i] += delta;
+    }
+}
+
+double WeightedItemChooser::totalWeight() const
+{
+    double total = 0;
+    for (std::size_t i = weights_.size(); i != 0; i -= i & (~i + 1))
+        total += sums_[i];
+    return total;
+}
+
+int WeightedItemChooser::randomItemId()
+{
+    const double total = totalWeight();
+    if (! (total > 0))
+        throw Error("can not choose random Item with zero total weight.");
+    if (! std::isfinite(total))
+        throw Error("total weight is too large.");
+    typedef std::uniform_real_distribution<double> Distribution;
+    double remainder = Distribution(0, total)(engine_);
+    // Find the first Item whose inclusive prefix sum exceeds remainder.
+    // Such Item always has positive weight.
+    std::size_t position = 0;
+    for (std::size_t bit = topBit_; bit != 0; bit >>= 1) {
+        const std::size_t next = position + bit;
+        if (next < sums_.size() && sums_[next] <= remainder) {
+            position = next;
+            remainder -= sums_[next];
+        }
+    }
+    // Rounding errors in accumulated sums could result in overshooting.
+    // Choose the last Item with positive weight then.
+    while (position >= weights_.size() || ! (weights_[position] > 0)) {
+        if (position == 0)
+            throw Error("can not choose random Item with zero total weight.");
+        --position;
+    }
+    return int(position);
+}
+
+void WeightedItemChooser::buildSums()
+{
+    sums_.assign(weights_.size() + 1, 0.0);
+    for (std::size_t i = 1; i < sums_.size(); ++i) {
+        sums_[i] += weights_[i - 1];
+        const std::size_t parent = i + (i & (~i + 1));
+        if (parent < sums_.size())
+            sums_[parent] += sums_[i];
+    }
+    topBit_ = 0;
+    if (! weights_.empty()) {
+        topBit_ = 1;
+        while (topBit_ * 2 <= weights_.size())
+            topBit_ *= 2;
+    }
+}
+
+
+
+ShuffleItemChooser::ShuffleItemChooser()
+    : ShuffleItemChooser(
+        static_cast<Key>(
+            std::chrono::system_clock::now().time_since_epoch().count()))
+{
+}
+
+ShuffleItemChooser::ShuffleItemChooser(const Key key,
+                                       const std::uint32_t position)
+    : key_(key), position_(position)
+{
+}
+
+int ShuffleItemChooser::itemIdAt(const Key key, const int itemCount,
+                                 const std::uint32_t position)
+{
+    if (position >= std::uint32_t(std::max(itemCount, 0)))
+        throw Error("no such position.");
+
+    // Balanced Feistel network over 2 * halfBits bits, where
+    // 2 ^ (2 * halfBits) is the smallest even power of 2 not less than
+    // itemCount. So values outside [0, itemCount) make less than 3/4 of the
+    // domain, and cycle-walking takes less than 4 iterations on average.
+    int halfBits = 1;
+    while ((std::uint64_t(1) << (2 * halfBits)) < std::uint64_t(itemCount))
+        ++halfBits;
+    const std::uint32_t mask = (std::uint32_t(1) << halfBits) - 1;
+
+    Key roundKeys[Shuffle::roundCount];
+    Key state = key;
+    for (Key & roundKey : roundKeys)
+        roundKey = Shuffle::splitMix(state);
+
+    std::uint32_t value = position;
+    do {
+        std::uint32_t left = value >> halfBits, right = value & mask;
+        for (const Key roundKey : roundKeys) {
+            const std::uint32_t newRight = left ^ (std::uint32_t(
+                mix(roundKey ^ right)) & mask);
+            left = right;
+            right = newRight;
+        }
+        value = (left << halfBits) | right;
+    }
+    while (value >= std::uint32_t(itemCount));
+    return int(value);
+}
+
+int ShuffleItemChooser::nextItemId(const int itemCount)
+{
+    if (itemCount == 0)
+        throw Error("can not choose random Item from tree without Items.");
+    if (itemCount != itemCount_) {
+        if (itemCount_ != -1 || position_ >= std::uint32_t(itemCount)) {
+            // Tree has changed since the last call: start a new order.
+            Shuffle::splitMix(key_);
+            position_ = 0;
+        }
+        itemCount_ = itemCount;
+    }
+    else if (position_ == std::uint32_t(itemCount)) {
+        // All Items were chosen: start a new order.
+        Shuffle::splitMix(key_);
+        position_ = 0;
+    }
+    return itemIdAt(key_, itemCount, position_++);
 }
 
 }
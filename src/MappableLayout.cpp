@@ -0,0 +1,101 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# include "MappableLayout.hpp"
+
+# include "ItemTree.hpp"
+
+# include <cstddef>
+# include <cstdint>
+# include <limits>
+# include <string>
+
+
+namespace ItemTree
+{
+namespace
+{
+std::string corruptedDataMessage()
+{
+    return "mapped tree is corrupted.";
+}
+
+}
+
+
+constexpr std::size_t MappableLayout::magicSize;
+const char MappableLayout::magic[MappableLayout::magicSize] = {
+    '\0', 'V', 'C', 'T', 'm', 'a', 'p', '\n'
+};
+constexpr std::uint32_t MappableLayout::version;
+constexpr std::size_t MappableLayout::headerSize;
+constexpr std::size_t MappableLayout::recordSize;
+constexpr std::uint32_t MappableLayout::playableBit;
+
+std::string MappableLayout::reset(const char * const data,
+                                  const std::size_t size)
+{
+    records_ = names_ = nullptr;
+    nodeCount_ = namesSize_ = 0;
+
+    if (size < headerSize || ! hasMagic(data, size))
+        return "wrong file format.";
+    const char * pos = data + magicSize;
+    const std::uint32_t fileVersion = LittleEndian::readUint32(pos);
+    if (fileVersion != version) {
+        return "wrong file format. Unsupported mappable version " +
+               std::to_string(fileVersion) + '.';
+    }
+    const std::uint32_t nodeCount = LittleEndian::readUint32(pos + 4);
+    const std::uint32_t namesSize = LittleEndian::readUint32(pos + 8);
+    // Using 64-bit arithmetic to prevent overflow.
+    const std::uint64_t expectedSize = std::uint64_t(headerSize) +
+                                       std::uint64_t(nodeCount) * recordSize +
+                                       namesSize;
+    if (nodeCount == 0 || expectedSize != size)
+        return "wrong file format. Unexpected file size.";
+
+    records_ = data + headerSize;
+    names_ = records_ + std::size_t(nodeCount) * recordSize;
+    nodeCount_ = nodeCount;
+    namesSize_ = namesSize;
+    if (nameSize(0) != 0 || isPlayable(0) ||
+            field(0, 4) > std::uint32_t(std::numeric_limits<int>::max())) {
+        records_ = names_ = nullptr;
+        nodeCount_ = namesSize_ = 0;
+        return "wrong file format. Invalid root node.";
+    }
+    return std::string();
+}
+
+void MappableLayout::checkName(const std::uint32_t node) const
+{
+    if (std::uint64_t(field(node, 0)) + nameSize(node) > namesSize_)
+        throw Error(corruptedDataMessage());
+}
+
+void MappableLayout::checkChildren(const std::uint32_t node) const
+{
+    const std::uint32_t first = firstChild(node), count = childCount(node);
+    if (count != 0 && (first <= node ||
+                       std::uint64_t(first) + count > nodeCount_)) {
+        throw Error(corruptedDataMessage());
+    }
+}
+
+}
@@ -0,0 +1,189 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_MAPPABLE_LAYOUT_HPP
+# define VENTUROUS_CORE_MAPPABLE_LAYOUT_HPP
+
+# include "ItemTree.hpp"
+
+# include <cstddef>
+# include <cstdint>
+# include <algorithm>
+# include <string>
+
+
+namespace ItemTree
+{
+namespace LittleEndian
+{
+inline void appendUint32(std::string & buffer, const std::uint32_t value)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+        buffer += static_cast<char>((value >> shift) & 0xFF);
+}
+
+inline void writeUint32(char * dest, const std::uint32_t value)
+{
+    for (int shift = 0; shift < 32; shift += 8, ++dest)
+        * dest = static_cast<char>((value >> shift) & 0xFF);
+}
+
+inline std::uint32_t readUint32(const char * source)
+{
+    std::uint32_t value = 0;
+    for (int shift = 0; shift < 32; shift += 8, ++source)
+        value |= std::uint32_t(static_cast<unsigned char>(* source)) << shift;
+    return value;
+}
+
+} // END namespace LittleEndian
+
+
+/// @brief Appends path to specified Item, relative to root, to path.
+/// @tparam FlatLayout Breadth-first array-based tree (MappableLayout or
+/// FlatTree), node 0 being root. Must provide isPlayable(), firstChild(),
+/// childCount(), accumulatedItemCount(), name(), nameSize(),
+/// checkChildren() and checkName() node-index accessors.
+/// @throw Error If there is no such Item or layout is corrupted.
+template <class FlatLayout>
+void appendFlatItemPath(const FlatLayout & layout, const int itemId,
+                        std::string & path)
+{
+    if (layout.nodeCount() == 0 || itemId < 0 ||
+            itemId >= layout.accumulatedItemCount(0)) {
+        throw Error("no such Item.");
+    }
+
+    // Same algorithm as in Node::appendRelativeItemPath().
+    std::uint32_t node = 0;
+    int relativeId = itemId;
+    while (relativeId != 0 || ! layout.isPlayable(node)) {
+        layout.checkChildren(node);
+        const std::uint32_t first = layout.firstChild(node);
+        const std::uint32_t last = first + layout.childCount(node);
+        // Find a child that contains (or is itself) the necessary Item.
+        std::uint32_t low = first, high = last;
+        while (low < high) {
+            const std::uint32_t middle = low + (high - low) / 2;
+            if (layout.accumulatedItemCount(middle) <= relativeId)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == last)
+            throw Error("no such child.");
+        if (low == first) {
+            if (layout.isPlayable(node))
+                --relativeId;
+        }
+        else
+            relativeId -= layout.accumulatedItemCount(low - 1);
+
+        node = low;
+        layout.checkName(node);
+        path.append(layout.name(node), layout.nameSize(node));
+        path += '/';
+    }
+    // remove extra '/'.
+    path.pop_back();
+}
+
+
+/// @brief Read-only view of a tree, serialized in Tree::Format::mappable.
+/// Layout: header {magic, version, node count, names size, reserved},
+/// node records, names. All integers are 32-bit little-endian.
+/// Nodes are stored in breadth-first order, so children of each node occupy
+/// consecutive records. Record 0 is root. Each record consists of
+/// {name offset, name size | playable bit, first child index, child count,
+/// accumulatedItemCount}. Names are not null-terminated.
+/// NOTE: constructing the view is O(1). Node indices and name bounds are
+/// checked lazily by accessors, so corrupted data results in Error rather than
+/// undefined behavior.
+class MappableLayout
+{
+public:
+    static constexpr std::size_t magicSize = 8;
+    static const char magic[magicSize];
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::size_t headerSize = magicSize + 4 * 4;
+    static constexpr std::size_t recordSize = 5 * 4;
+    static constexpr std::uint32_t playableBit = std::uint32_t(1) << 31;
+
+    /// @return true if data starts with magic.
+    static bool hasMagic(const char * data, std::size_t size) {
+        return size >= magicSize && std::equal(magic, magic + magicSize, data);
+    }
+
+    /// @brief Attaches this view to [data, data + size).
+    /// @return Empty string if data has valid header and size.
+    /// Error message otherwise.
+    std::string reset(const char * data, std::size_t size);
+
+    std::uint32_t nodeCount() const { return nodeCount_; }
+
+    const char * name(std::uint32_t node) const {
+        return names_ + field(node, 0);
+    }
+    std::uint32_t nameSize(std::uint32_t node) const {
+        return field(node, 1) & ~playableBit;
+    }
+    bool isPlayable(std::uint32_t node) const {
+        return (field(node, 1) & playableBit) != 0;
+    }
+    std::uint32_t firstChild(std::uint32_t node) const {
+        return field(node, 2);
+    }
+    std::uint32_t childCount(std::uint32_t node) const {
+        return field(node, 3);
+    }
+    int accumulatedItemCount(std::uint32_t node) const {
+        return static_cast<int>(field(node, 4));
+    }
+    /// @return Number of playable descendants of node (including node itself).
+    int itemCount(std::uint32_t node) const {
+        const std::uint32_t count = childCount(node);
+        return count == 0 ? (isPlayable(node) ? 1 : 0)
+               : accumulatedItemCount(firstChild(node) + count - 1);
+    }
+
+    /// @throw Error If name of node is out of bounds.
+    void checkName(std::uint32_t node) const;
+    /// @throw Error If children of node are out of bounds or precede node.
+    void checkChildren(std::uint32_t node) const;
+
+    /// @brief Appends path to specified Item, relative to root, to path.
+    /// @throw Error If there is no such Item or data is corrupted.
+    void appendItemAbsolutePath(int itemId, std::string & path) const {
+        appendFlatItemPath(* this, itemId, path);
+    }
+
+private:
+    std::uint32_t field(std::uint32_t node, std::size_t index) const {
+        return LittleEndian::readUint32(
+                   records_ + node * recordSize + index * 4);
+    }
+
+    const char * records_ = nullptr;
+    const char * names_ = nullptr;
+    std::uint32_t nodeCount_ = 0;
+    std::uint32_t namesSize_ = 0;
+};
+
+}
+
+# endif // VENTUROUS_CORE_MAPPABLE_LAYOUT_HPP
@@ -0,0 +1,96 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# include "MappedTree.hpp"
+
+# include "MappableLayout.hpp"
+
+# include <QtCoreUtilities/String.hpp>
+
+# include <QFile>
+
+# include <cstddef>
+# include <utility>
+# include <string>
+
+
+namespace ItemTree
+{
+MappedTree::MappedTree() = default;
+
+MappedTree::~MappedTree() = default;
+
+std::string MappedTree::open(const std::string & filename)
+{
+    close();
+
+    std::unique_ptr<QFile> file(new QFile(QtUtilities::toQString(filename)));
+    if (! file->open(QFile::ReadOnly))
+        return "opening file \"" + filename + "\" failed.";
+    const qint64 size = file->size();
+    if (size < qint64(MappableLayout::headerSize))
+        return "wrong file format.";
+    const uchar * const data = file->map(0, size);
+    if (data == nullptr)
+        return "mapping file \"" + filename + "\" failed.";
+
+    std::unique_ptr<MappableLayout> layout(new MappableLayout);
+    const std::string error = layout->reset(
+                                  reinterpret_cast<const char *>(data),
+                                  static_cast<std::size_t>(size));
+    if (! error.empty())
+        return error;
+
+    file_ = std::move(file);
+    layout_ = std::move(layout);
+    return std::string();
+}
+
+void MappedTree::close()
+{
+    // Layout must not outlive the mapping.
+    layout_.reset();
+    file_.reset();
+}
+
+bool MappedTree::isOpen() const
+{
+    return layout_ != nullptr;
+}
+
+int MappedTree::itemCount() const
+{
+    return isOpen() ? layout_->accumulatedItemCount(0) : 0;
+}
+
+std::string MappedTree::getItemAbsolutePath(const int itemId) const
+{
+    std::string path;
+    getItemAbsolutePath(itemId, path);
+    return path;
+}
+
+void MappedTree::getItemAbsolutePath(const int itemId, std::string & path) const
+{
+    if (! isOpen())
+        throw Error("no such Item.");
+    path.clear();
+    layout_->appendItemAbsolutePath(itemId, path);
+}
+
+}
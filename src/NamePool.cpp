@@ -0,0 +1,227 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# include "NamePool.hpp"
+
+# include "ItemTree.hpp"
+
+# include <cstddef>
+# include <cstdint>
+# include <cstring>
+# include <utility>
+# include <vector>
+# include <string>
+# include <atomic>
+# include <mutex>
+
+
+namespace ItemTree
+{
+namespace
+{
+/// @brief Hints the processor to start loading address into cache.
+inline void prefetch(const void * const address)
+{
+# ifdef __GNUC__
+    __builtin_prefetch(address);
+# else
+    (void)address;
+# endif
+}
+
+}
+
+
+constexpr unsigned NamePool::chunkBits;
+constexpr NamePool::Id NamePool::chunkSize;
+constexpr std::size_t NamePool::maxChunkCount;
+constexpr std::uint64_t NamePool::tagMask;
+
+NamePool & NamePool::instance()
+{
+    static NamePool pool;
+    return pool;
+}
+
+NamePool::Table::Table(const std::size_t size)
+    : mask(size - 1), slots(new std::atomic<std::uint64_t>[size])
+{
+    for (std::size_t i = 0; i < size; ++i)
+        slots[i].store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t NamePool::hash(const char * name, std::size_t size)
+{
+    // Processes 8 bytes at a time, then mixes bits with the SplitMix64
+    // finalizer.
+    std::uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size;
+    for (; size >= 8; name += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(& word, name, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    if (size != 0) {
+        std::uint64_t word = 0;
+        std::memcpy(& word, name, size);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+NamePool::NamePool()
+{
+    tables_.emplace_back(new Table(1024));
+    table_.store(tables_.back().get(), std::memory_order_release);
+}
+
+NamePool::Id NamePool::intern(const char * const name, const std::size_t size)
+{
+    const std::uint64_t nameHash = hash(name, size);
+    Id id = find(* table_.load(std::memory_order_acquire), name, size,
+                 nameHash);
+    if (id != invalidId())
+        return id;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Another thread could have added this name before the lock.
+    id = find(* table_.load(std::memory_order_relaxed), name, size, nameHash);
+    if (id != invalidId())
+        return id;
+    reserveLocked(1);
+    return add(name, size, nameHash);
+}
+
+void NamePool::intern(const Name * const names, const std::size_t count,
+                      Id * const ids)
+{
+    // Hashes are computed in advance, so that table slots of next names
+    // are fetched from memory while current name is being processed.
+    constexpr std::size_t lookahead = 8;
+    std::vector<std::uint64_t> hashes(count);
+    for (std::size_t i = 0; i < count; ++i)
+        hashes[i] = hash(names[i].data, names[i].size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    reserveLocked(count);
+    // The table does not grow in this loop thanks to reserveLocked().
+    const Table & table = * table_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i + lookahead < count) {
+            prefetch(& table.slots[initialSlot(
+                                      hashes[i + lookahead] & tagMask,
+                                      table.mask)]);
+        }
+        const Name & name = names[i];
+        ids[i] = find(table, name.data, name.size, hashes[i]);
+        if (ids[i] == invalidId())
+            ids[i] = add(name.data, name.size, hashes[i]);
+    }
+}
+
+void NamePool::reserve(const std::size_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    reserveLocked(count);
+}
+
+NamePool::Id NamePool::add(const char * const name, const std::size_t size,
+                           const std::uint64_t nameHash)
+{
+    const Id id = size_;
+    if (id == invalidId())
+        throw Error("too many distinct node names.");
+    std::unique_ptr<std::string[]> & chunk = chunks_[id >> chunkBits];
+    if (chunk == nullptr)
+        chunk.reset(new std::string[chunkSize]);
+    chunk[id & (chunkSize - 1)].assign(name, size);
+    ++size_;
+    insert(* table_.load(std::memory_order_relaxed), makeEntry(id, nameHash));
+    return id;
+}
+
+void NamePool::reserveLocked(const std::size_t count)
+{
+    // Load factor does not exceed 1/2.
+    const std::size_t required = 2 * (std::size_t(size_) + count);
+    std::size_t tableSize = table_.load(std::memory_order_relaxed)->mask + 1;
+    if (tableSize >= required)
+        return;
+    while (tableSize < required)
+        tableSize *= 2;
+    grow(tableSize);
+}
+
+NamePool::Id NamePool::find(const char * const name,
+                            const std::size_t size) const
+{
+    return find(* table_.load(std::memory_order_acquire), name, size,
+                hash(name, size));
+}
+
+NamePool::Id NamePool::find(const Table & table, const char * const name,
+                            const std::size_t size,
+                            const std::uint64_t nameHash) const
+{
+    const std::uint64_t tag = makeEntry(0, nameHash) & tagMask;
+    for (std::size_t slot = initialSlot(tag, table.mask); ;
+            slot = (slot + 1) & table.mask) {
+        // Acquire pairs with release in insert(), so the name is visible.
+        const std::uint64_t entry =
+            table.slots[slot].load(std::memory_order_acquire);
+        if (entry == 0)
+            return invalidId();
+        if ((entry & tagMask) != tag)
+            continue;
+        const Id id = Id(entry) - 1;
+        const std::string & stored = this->name(id);
+        if (stored.size() == size &&
+                std::char_traits<char>::compare(stored.data(), name, size) == 0)
+            return id;
+    }
+}
+
+void NamePool::grow(const std::size_t tableSize)
+{
+    const Table & table = * table_.load(std::memory_order_relaxed);
+    std::unique_ptr<Table> grown(new Table(tableSize));
+    // Slots are chosen by hash bits stored in entries, so names are not read
+    // and hashed again.
+    for (std::size_t slot = 0; slot <= table.mask; ++slot) {
+        const std::uint64_t entry =
+            table.slots[slot].load(std::memory_order_relaxed);
+        if (entry != 0)
+            insert(* grown, entry);
+    }
+    tables_.push_back(std::move(grown));
+    // Concurrent lookups in the old table may miss names that are being
+    // added, which is the same as if they were added later.
+    table_.store(tables_.back().get(), std::memory_order_release);
+}
+
+void NamePool::insert(Table & table, const std::uint64_t entry)
+{
+    std::size_t slot = initialSlot(entry & tagMask, table.mask);
+    while (table.slots[slot].load(std::memory_order_relaxed) != 0)
+        slot = (slot + 1) & table.mask;
+    table.slots[slot].store(entry, std::memory_order_release);
+}
+
+}
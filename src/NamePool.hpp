@@ -0,0 +1,149 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# ifndef VENTUROUS_CORE_NAME_POOL_HPP
+# define VENTUROUS_CORE_NAME_POOL_HPP
+
+# include <cstddef>
+# include <cstdint>
+# include <memory>
+# include <string>
+# include <vector>
+# include <atomic>
+# include <mutex>
+
+
+namespace ItemTree
+{
+/// @brief Process-wide pool of interned node names. Each distinct name is
+/// stored once and identified by a 32-bit id, so equal names have equal ids
+/// in all trees.
+/// NOTE: names are never removed from the pool. This is fine for node names,
+/// which repeat a lot and whose total number of distinct values is bounded by
+/// the file system.
+/// NOTE: all methods are thread-safe. find(), name() and intern() of a name
+/// that is already in the pool do not lock: ids are published in a
+/// lock-free open-addressing table, which is replaced (never modified in
+/// place) when it grows. Only intern() of a new name locks.
+class NamePool
+{
+public:
+    typedef std::uint32_t Id;
+
+    /// Name, which does not need to be null-terminated.
+    struct Name {
+        const char * data;
+        std::size_t size;
+    };
+
+    static NamePool & instance();
+
+    /// @return Id of specified name. Name is added to the pool if it is not
+    /// present yet.
+    Id intern(const char * name, std::size_t size);
+    Id intern(const std::string & name) {
+        return intern(name.data(), name.size());
+    }
+
+    /// @brief Same as calling intern() for each of names, but faster: the
+    /// pool is locked once and memory accesses for successive names overlap.
+    /// @param ids Id of names[i] is assigned to ids[i].
+    void intern(const Name * names, std::size_t count, Id * ids);
+
+    /// @brief Prepares the pool for interning count more names, so that the
+    /// lookup table is not rebuilt while they are added one by one.
+    void reserve(std::size_t count);
+
+    /// @return Id of specified name or invalidId() if the pool does not
+    /// contain such name (which means that no node has this name).
+    Id find(const char * name, std::size_t size) const;
+
+    static constexpr Id invalidId() { return ~Id(0); }
+
+    /// @return Name with specified id, which must have been returned by
+    /// intern().
+    const std::string & name(const Id id) const {
+        return chunks_[id >> chunkBits][id & (chunkSize - 1)];
+    }
+
+private:
+    static constexpr unsigned chunkBits = 16;
+    static constexpr Id chunkSize = Id(1) << chunkBits;
+    static constexpr std::size_t maxChunkCount = std::size_t(1) << chunkBits;
+
+    /// Each slot is 0 (empty) or {tag: high 32 bits of name hash, id + 1}.
+    /// Comparing tags lets lookups skip most foreign names without reading
+    /// them. Initial slot is determined by the tag, so the table can grow
+    /// without rehashing names.
+    struct Table {
+        explicit Table(std::size_t size);
+
+        std::size_t mask;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> slots;
+    };
+
+    static constexpr std::uint64_t tagMask = ~std::uint64_t(0xFFFFFFFF);
+
+    static std::uint64_t hash(const char * name, std::size_t size);
+
+    static std::uint64_t makeEntry(const Id id, const std::uint64_t nameHash) {
+        return (nameHash & tagMask) | (std::uint64_t(id) + 1);
+    }
+
+    static std::size_t initialSlot(const std::uint64_t tag,
+                                   const std::size_t mask) {
+        return std::size_t(tag >> 32) & mask;
+    }
+
+    explicit NamePool();
+
+    /// @return Id of specified name in table or invalidId().
+    Id find(const Table & table, const char * name, std::size_t size,
+            std::uint64_t nameHash) const;
+
+    /// @brief Publishes entry in table. Must be called with mutex_ locked.
+    static void insert(Table & table, std::uint64_t entry);
+
+    /// @brief Adds name, which is not in the pool, to the current table.
+    /// Must be called with mutex_ locked, after reserveLocked().
+    /// @return Id of the added name.
+    Id add(const char * name, std::size_t size, std::uint64_t nameHash);
+
+    /// @brief Implements reserve(). Must be called with mutex_ locked.
+    void reserveLocked(std::size_t count);
+
+    /// @brief Replaces current table with a table of specified size, which
+    /// must be a power of 2. Must be called with mutex_ locked.
+    void grow(std::size_t tableSize);
+
+    /// Names are stored in fixed-size chunks, which are never reallocated, so
+    /// name() does not need locking.
+    std::unique_ptr<std::string[]> chunks_[maxChunkCount];
+    std::atomic<Table *> table_;
+    /// Current table and all replaced tables, which may still be read by
+    /// concurrent lookups. Replaced tables take at most as much memory as
+    /// the current one, because each table is twice as large as the previous.
+    std::vector<std::unique_ptr<Table>> tables_;
+    /// Number of interned names. Is modified with mutex_ locked.
+    Id size_ = 0;
+    std::mutex mutex_;
+};
+
+}
+
+# endif // VENTUROUS_CORE_NAME_POOL_HPP
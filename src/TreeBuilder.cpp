@@ -0,0 +1,111 @@
+/*
+ This file is part of VenturousCore.
+ Copyright (C) 2014, 2015 Igor Kushnir <igorkuo AT Google mail>
+
+ VenturousCore is free software: you can redistribute it and/or
+ modify it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ VenturousCore is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along with
+ VenturousCore.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# include "TreeBuilder.hpp"
+
+# include "ItemTree.hpp"
+# include "Concurrency.hpp"
+
+# include <cstddef>
+# include <algorithm>
+# include <vector>
+# include <string>
+
+
+namespace ItemTree
+{
+namespace
+{
+/// @return End of the path component that starts at begin. Components are
+/// split exactly as in Node::insertItem(): the first symbol of a component is
+/// never treated as separator.
+std::size_t componentEnd(const std::string & path, const std::size_t begin)
+{
+    return std::min(path.find('/', begin + 1), path.size());
+}
+
+/// Orders paths component by component, which matches the order of nodes in
+/// Node::children(). Plain string comparison does not, because '/' is
+/// greater than some symbols that can appear in names.
+struct ComparePaths {
+    bool operator()(const std::string & lhs, const std::string & rhs) const {
+        std::size_t lhsBegin = 0, rhsBegin = 0;
+        while (true) {
+            if (lhsBegin >= lhs.size())
+                return rhsBegin < rhs.size();
+            if (rhsBegin >= rhs.size())
+                return false;
+            const std::size_t lhsEnd = componentEnd(lhs, lhsBegin);
+            const std::size_t rhsEnd = componentEnd(rhs, rhsBegin);
+            const int result = lhs.compare(lhsBegin, lhsEnd - lhsBegin, rhs,
+                                           rhsBegin, rhsEnd - rhsBegin);
+            if (result != 0)
+                return result < 0;
+            lhsBegin = lhsEnd + 1;
+            rhsBegin = rhsEnd + 1;
+        }
+    }
+};
+
+}
+
+
+Tree TreeBuilder::build()
+{
+    std::vector<std::string> paths;
+    paths.swap(paths_);
+    Concurrency::parallelSort(paths.begin(), paths.end(), ComparePaths());
+
+    Tree tree;
+    /// nodeStack[i] is the last node at level i of the previous path.
+    std::vector<Node *> nodeStack { & tree.root_ };
+    for (const std::string & path : paths) {
+        std::size_t level = 1;
+        bool matching = true;
+        for (std::size_t begin = 0; begin < path.size(); ++level) {
+            const std::size_t end = componentEnd(path, begin);
+            if (end + 1 == path.size())
+                throw Error("path ends with '/'.");
+
+            if (matching && level < nodeStack.size()) {
+                const std::string & name = nodeStack[level]->name();
+                matching = name.size() == end - begin &&
+                           path.compare(begin, end - begin, name) == 0;
+            }
+            else
+                matching = false;
+            if (! matching) {
+                // Paths are sorted, so the new node is greater than all
+                // existing children of its parent.
+                nodeStack.resize(level);
+                std::vector<Node> & children = nodeStack.back()->children_;
+                children.emplace_back(Node(path.data() + begin, end - begin,
+                                           false));
+                nodeStack.emplace_back(& children.back());
+            }
+            begin = end + 1;
+        }
+        if (level > 1)
+            nodeStack[level - 1]->playable_ = true;
+    }
+
+    tree.nodesChanged();
+    return tree;
+}
+
+}